@@ -1,2 +1,2 @@
 #!/usr/bin/env bash
-kill -9 $( cat webserver.pid )
+kill $( cat webserver.pid )
@@ -9,11 +9,26 @@
 #include <fcntl.h>
 #include <cstring>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IORING_FEAT_EXT_ARG) && defined(IORING_ACCEPT_MULTISHOT)
+#define HAVE_IO_URING 1
+#endif
 
 using namespace std;
 
 #define MAX_EVENTS 32
 #define BUFFER_SIZE 4096
+#define URING_ENTRIES 64
+#define URING_BUFFERS 64
 
 char const *header_200_text_html = "HTTP/1.0 200 OK\nServer: MultiProcessWebServer v0.1\nContent-Type: text/html\n\n";
 char const *header_200_image_png = "HTTP/1.0 200 OK\nServer: MultiProcessWebServer v0.1\nContent-Disposition: inline\nContent-Type: image/png\n\n";
@@ -263,7 +278,298 @@ int calc(char * buffer, int *body_begin_index) {
 	return 0;
 }
 
-int main() {
+/*
+	Answers the request in buffer and closes the connection
+*/
+void serve_request(int fd, char * buffer, const string &target_directory) {
+	cout << "===header===" << endl;
+	cout << buffer;
+	cout << "============" << endl;
+
+	int method_last_index = 0;
+
+	method _method = extract_method(buffer, BUFFER_SIZE, &method_last_index);
+
+	if(_method == UNKNOWN) {
+		cout << "Incorrect method!" << endl;
+		send(fd, header_400, strlen(header_400), MSG_NOSIGNAL);
+		send(fd, body_400, strlen(body_400), MSG_NOSIGNAL);
+		shutdown(fd, SHUT_RDWR);
+		close(fd);
+		return;
+	}
+
+	int route_begin_index = 0;
+	int route_end_index = 0;
+
+	extract_route(buffer, BUFFER_SIZE, &method_last_index, &route_begin_index, &route_end_index);
+
+	http_version _http_version =  extract_http_version(buffer, BUFFER_SIZE, &route_end_index);
+
+	char * file_path = extract_file_path(buffer, &route_begin_index, &route_end_index);
+
+	cout << "file_path = '" << file_path << "'" << endl;
+
+	switch(_method) {
+		case GET: {
+			string full_file_path(target_directory);
+
+			if(strcmp(file_path, root_directory) == 0) {
+				full_file_path += default_page;
+			} else {
+				full_file_path += file_path;
+			}
+
+			cout << "full_file_path = '" << full_file_path << "'" << endl;
+
+			ifstream file_input(full_file_path.c_str(), std::ios::binary);
+
+			if(file_input && file_exists(full_file_path)) {
+				std::string content( (std::istreambuf_iterator<char>(file_input) ), (std::istreambuf_iterator<char>()) );
+
+				content_type _content_type = get_content_type(full_file_path.c_str());
+
+				switch(_content_type) {
+					case HTML: {
+						send(fd, header_200_text_html, strlen(header_200_text_html), MSG_NOSIGNAL);
+						break;
+					}
+					case JS: {
+						send(fd, header_200_text_javascript, strlen(header_200_text_javascript), MSG_NOSIGNAL);
+						break;
+					}
+					case PNG: {
+						send(fd, header_200_image_png, strlen(header_200_image_png), MSG_NOSIGNAL);
+						break;
+					}
+					default: {
+						send(fd, header_200_application_octet_stream, strlen(header_200_application_octet_stream), MSG_NOSIGNAL);
+						break;
+					}
+				}
+
+				
+				send(fd, content.c_str(), content.size(), MSG_NOSIGNAL);
+			} else {
+				cout << "File '" << full_file_path << "' not found" << endl;
+				send(fd, header_404, strlen(header_404), MSG_NOSIGNAL);
+			}
+
+			break;
+		}
+		case POST: {
+
+			if(strcmp(file_path, route_calc) != 0) {
+				send(fd, header_404, strlen(header_404), MSG_NOSIGNAL);
+			} else {
+
+				int body_begin_index = -1;
+
+				extract_body(buffer, BUFFER_SIZE, &body_begin_index);
+
+				if(body_begin_index == -1) {
+					send(fd, header_400, strlen(header_400), MSG_NOSIGNAL);
+					send(fd, body_400, strlen(body_400), MSG_NOSIGNAL);
+				} else {
+
+					int calc_result = calc(buffer, &body_begin_index);
+
+					string json_result = "{\n\t\"result\": " + to_string(calc_result) + "\n}";
+
+					send(fd, header_200_application_json, strlen(header_200_application_json), MSG_NOSIGNAL);
+					send(fd, json_result.c_str(), json_result.size(), MSG_NOSIGNAL);
+				}
+			}
+			break;
+		}
+	}
+
+	delete[] file_path;
+
+	cout << "shutdown fd " << fd << endl;
+	shutdown(fd, SHUT_RDWR);
+	close(fd);
+}
+
+#ifdef HAVE_IO_URING
+/*
+	io_uring loop: multishot accept on the listening socket and every
+	request received into a buffer the kernel picks from a provided group,
+	so there are no accept() and recv() calls. Answers go out with send()
+	as in the epoll loop. Driven with raw syscalls, no liburing.
+*/
+#define URING_ACCEPT (1ULL << 63)
+#define URING_INTERNAL (1ULL << 62)
+
+struct uring_t {
+	int fd;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned queued;
+	vector<char> buffers;
+};
+
+struct io_uring_sqe *uring_sqe(uring_t &ring) {
+	unsigned tail = *ring.sq_tail;
+	struct io_uring_sqe *sqe = &ring.sqes[tail & ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring.queued;
+	return sqe;
+}
+
+// One buffer more than BUFFER_SIZE leaves room for a terminating zero
+void uring_provide(uring_t &ring, int first, int count) {
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (uint64_t)(uintptr_t)&ring.buffers[(size_t)first * (BUFFER_SIZE + 1)];
+	sqe->len = BUFFER_SIZE + 1;
+	sqe->off = first;
+	sqe->user_data = URING_INTERNAL;
+}
+
+void uring_accept(uring_t &ring, int master_socket) {
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = master_socket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_ACCEPT;
+}
+
+void uring_recv(uring_t &ring, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->len = BUFFER_SIZE;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint32_t)fd;
+}
+
+/*
+	Returns only when io_uring can not be used
+*/
+int uring_loop(int master_socket, const string &target_directory) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	uring_t ring;
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if(ring.fd == -1) {
+		cout << "io_uring_setup error: " << strerror(errno) << endl;
+		return -1;
+	}
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		cout << "io_uring is too old" << endl;
+		close(ring.fd);
+		return -1;
+	}
+
+	size_t ring_size = max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+	char *rings = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(rings == MAP_FAILED || sqes == MAP_FAILED) {
+		cout << "io_uring mmap error: " << strerror(errno) << endl;
+		close(ring.fd);
+		return -1;
+	}
+
+	ring.sq_tail = (unsigned *)(rings + params.sq_off.tail);
+	ring.sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+	ring.sqes = (struct io_uring_sqe *)sqes;
+	ring.cq_head = (unsigned *)(rings + params.cq_off.head);
+	ring.cq_tail = (unsigned *)(rings + params.cq_off.tail);
+	ring.cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+	ring.queued = 0;
+
+	unsigned *sq_array = (unsigned *)(rings + params.sq_off.array);
+	for(unsigned i = 0; i < params.sq_entries; ++i) {
+		sq_array[i] = i;
+	}
+
+	ring.buffers.resize((size_t)URING_BUFFERS * (BUFFER_SIZE + 1));
+	uring_provide(ring, 0, URING_BUFFERS);
+	uring_accept(ring, master_socket);
+
+	bool accepting = false;
+
+	while(true) {
+		cout << "wait completions..." << endl;
+		// Each completion queues at most two SQEs: half the ring is always enough
+		int submitted = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(submitted < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			cout << "io_uring_enter error: " << strerror(errno) << endl;
+			close(ring.fd);
+			return -1;
+		}
+		ring.queued -= submitted;
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for(int n = 0; head != tail && n < URING_ENTRIES / 2; ++head, ++n) {
+			struct io_uring_cqe cqe = ring.cqes[head & ring.cq_mask];
+
+			if(cqe.user_data == URING_INTERNAL) {
+				continue;
+			}
+
+			if(cqe.user_data == URING_ACCEPT) {
+				if(cqe.res == -EINVAL && !accepting) {
+					cout << "No multishot accept in this kernel" << endl;
+					close(ring.fd);
+					return -1;
+				}
+				accepting = true;
+				if(!(cqe.flags & IORING_CQE_F_MORE)) {
+					uring_accept(ring, master_socket);
+				}
+				if(cqe.res >= 0) {
+					cout << "Connection accepted: " << cqe.res << endl;
+					uring_recv(ring, cqe.res);
+				}
+				continue;
+			}
+
+			int fd = (uint32_t)cqe.user_data;
+			cout << "recv_result for " << fd << " = " << cqe.res << endl;
+
+			if(cqe.res == -ENOBUFS) {
+				// Every buffer is taken: try again once the given back ones are in
+				uring_recv(ring, fd);
+				continue;
+			}
+
+			if(cqe.res <= 0) {
+				cout << "Close " <<  fd << endl;
+				shutdown(fd, SHUT_RDWR);
+				close(fd);
+			} else {
+				int buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+				char * buffer = &ring.buffers[(size_t)buffer_id * (BUFFER_SIZE + 1)];
+				buffer[cqe.res] = '\0';
+				serve_request(fd, buffer, target_directory);
+			}
+
+			if(cqe.flags & IORING_CQE_F_BUFFER) {
+				uring_provide(ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT, 1);
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+#endif
+
+int main(int argc, char **argv) {
 
 	cout << "Welcome to Epoll server" << endl;
 
@@ -309,6 +615,15 @@ int main() {
 
 	listen(master_socket, SOMAXCONN);
 
+	if(argc > 1 && strcmp(argv[1], "uring") == 0) {
+#ifdef HAVE_IO_URING
+		uring_loop(master_socket, target_directory);
+		cout << "io_uring is not available, falling back to epoll" << endl;
+#else
+		cout << "Built without io_uring, falling back to epoll" << endl;
+#endif
+	}
+
 	int EPoll = epoll_create1(0);
 
 	struct epoll_event event;
@@ -348,114 +663,7 @@ int main() {
 					shutdown(fd, SHUT_RDWR);
 					close(fd);
 				} else {
-					cout << "===header===" << endl;
-					cout << buffer;
-					cout << "============" << endl;
-
-					int method_last_index = 0;
-
-					method _method = extract_method(buffer, BUFFER_SIZE, &method_last_index);
-
-					if(_method == UNKNOWN) {
-						cout << "Incorrect method!" << endl;
-						send(fd, header_400, strlen(header_400), MSG_NOSIGNAL);
-						send(fd, body_400, strlen(body_400), MSG_NOSIGNAL);
-						shutdown(fd, SHUT_RDWR);
-						close(fd);
-						continue;
-					}
-
-					int route_begin_index = 0;
-					int route_end_index = 0;
-
-					extract_route(buffer, BUFFER_SIZE, &method_last_index, &route_begin_index, &route_end_index);
-
-					http_version _http_version =  extract_http_version(buffer, BUFFER_SIZE, &route_end_index);
-
-					char * file_path = extract_file_path(buffer, &route_begin_index, &route_end_index);
-
-					cout << "file_path = '" << file_path << "'" << endl;
-
-					switch(_method) {
-						case GET: {
-							string full_file_path(target_directory);
-
-							if(strcmp(file_path, root_directory) == 0) {
-								full_file_path += default_page;
-							} else {
-								full_file_path += file_path;
-							}
-
-							cout << "full_file_path = '" << full_file_path << "'" << endl;
-
-							ifstream file_input(full_file_path.c_str(), std::ios::binary);
-
-							if(file_input && file_exists(full_file_path)) {
-								std::string content( (std::istreambuf_iterator<char>(file_input) ), (std::istreambuf_iterator<char>()) );
-
-								content_type _content_type = get_content_type(full_file_path.c_str());
-
-								switch(_content_type) {
-									case HTML: {
-										send(fd, header_200_text_html, strlen(header_200_text_html), MSG_NOSIGNAL);
-										break;
-									}
-									case JS: {
-										send(fd, header_200_text_javascript, strlen(header_200_text_javascript), MSG_NOSIGNAL);
-										break;
-									}
-									case PNG: {
-										send(fd, header_200_image_png, strlen(header_200_image_png), MSG_NOSIGNAL);
-										break;
-									}
-									default: {
-										send(fd, header_200_application_octet_stream, strlen(header_200_application_octet_stream), MSG_NOSIGNAL);
-										break;
-									}
-								}
-
-								
-								send(fd, content.c_str(), content.size(), MSG_NOSIGNAL);
-							} else {
-								cout << "File '" << full_file_path << "' not found" << endl;
-								send(fd, header_404, strlen(header_404), MSG_NOSIGNAL);
-							}
-
-							break;
-						}
-						case POST: {
-
-							if(strcmp(file_path, route_calc) != 0) {
-								send(fd, header_404, strlen(header_404), MSG_NOSIGNAL);
-							} else {
-
-								int body_begin_index = -1;
-
-								extract_body(buffer, BUFFER_SIZE, &body_begin_index);
-
-								if(body_begin_index == -1) {
-									send(fd, header_400, strlen(header_400), MSG_NOSIGNAL);
-									send(fd, body_400, strlen(body_400), MSG_NOSIGNAL);
-								} else {
-
-									int calc_result = calc(buffer, &body_begin_index);
-
-									string json_result = "{\n\t\"result\": " + to_string(calc_result) + "\n}";
-
-									send(fd, header_200_application_json, strlen(header_200_application_json), MSG_NOSIGNAL);
-									send(fd, json_result.c_str(), json_result.size(), MSG_NOSIGNAL);
-								}
-							}
-							break;
-						}
-					}
-
-					delete[] file_path;
-
-					cout << "shutdown fd " << fd << endl;
-					shutdown(fd, SHUT_RDWR);
-					close(fd);
-
+					serve_request(fd, buffer, target_directory);
 				}
 
 			}
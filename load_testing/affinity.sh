@@ -0,0 +1,25 @@
+#!/usr/bin/env bash
+# Latency with and without CPU pinning and connection steering (-k, -s).
+# Runs on the Linux host of the server, after the build in the repository root:
+#   ./affinity.sh [<directory>] [<workers>]
+# Every configuration gets the same yandex-tank run (affinity.yaml);
+# p50/p99/p99.9 come from its phout log.
+cd "$(dirname "$0")"
+ROOT=$(cd .. && pwd)
+DIRECTORY=${1:-$ROOT/static-site}
+WORKERS=${2:-$(nproc)}
+
+for config in "-k off" "-k auto" "-k auto -s cpu" "-k auto -s cbpf"; do
+	(cd "$ROOT" && ./webserver -h 127.0.0.1 -p 11777 -d "$DIRECTORY" -w $WORKERS -l 1 $config > /dev/null)
+	sleep $((WORKERS / 2 + 2))
+
+	sudo docker run --rm -v "$(pwd)":/var/loadtest --net host direvius/yandex-tank -c affinity.yaml > /dev/null
+
+	kill $(cat "$ROOT/webserver.pid")
+	sleep 2
+
+	phout=$(ls -t logs/*/phout*.log | head -1)
+	# Column 3: request time in microseconds
+	echo "$config: $(awk -F'\t' '{print $3}' "$phout" | sort -n | awk 'function rank(q, i) {i = int(NR * q); if(i < NR * q) ++i; return t[i > 0 ? i : 1]}
+		{t[NR] = $1} END {printf "%d requests, p50 %d us, p99 %d us, p99.9 %d us", NR, rank(0.5), rank(0.99), rank(0.999)}')"
+done
@@ -0,0 +1,308 @@
+/*
+	Request parsing microbenchmark: the previous byte-by-byte parser, which
+	walked the header again for every header it looked up, against
+	http_parse() with each version of scan_bytes() (scalar, SSE2, AVX2),
+	which indexes the header once.
+
+	Every iteration does what the server does for a static GET: finds the
+	end of the header, parses the request line, gets Transfer-Encoding,
+	Content-Length, Connection, Accept-Encoding, If-None-Match,
+	If-Modified-Since and Range, and gets the file path.
+
+	Build and run with parse_bench.sh.
+*/
+#define main webserver_main
+#include "../webserver.cpp"
+#undef main
+
+#include <chrono>
+
+/*
+	PREVIOUS PARSER
+*/
+method old_extract_method(char * buffer, int buffer_size, int *method_last_index) {
+
+	for(int p = 0; p < buffer_size; ++p) {
+		if(buffer[p] == ' ') {
+			if(p == 4 && buffer[0] == 'P' && buffer[1] == 'O' && buffer[2] == 'S' && buffer[3] == 'T') {
+				*method_last_index = p;
+				return POST;
+			} else if (p == 3 && buffer[0] == 'G' && buffer[1] == 'E' && buffer[2] == 'T') {
+				*method_last_index = p;
+				return GET;
+			} else {
+				return UNKNOWN;
+			}
+		}
+	}
+
+	return UNKNOWN;
+}
+
+void old_extract_route(char * buffer, int buffer_size, int *method_last_index, int *route_begin_index, int *route_end_index) {
+	*route_begin_index = *method_last_index + 1;
+	for(int i = *route_begin_index + 1; i < buffer_size; ++i) {
+		if(buffer[i] == ' ') {
+			*route_end_index = i;
+			break;
+		}
+	}
+}
+
+char * old_extract_file_path(char * buffer, int *route_begin_index, int *route_end_index) {
+	int index = *route_end_index;
+
+	for(int i = *route_begin_index; i < *route_end_index; ++i) {
+		if(buffer[i] == '?') {
+			index = i;
+			break;
+		}
+	}
+
+	char * filePath = new char[index - *route_begin_index + 1];
+	int i = 0;
+	for(i = *route_begin_index; i < index; ++i) {
+		filePath[i - *route_begin_index] = buffer[i];
+	}
+	filePath[i - *route_begin_index] = '\0';
+	return filePath;
+}
+
+http_version old_extract_http_version(char * buffer, int buffer_size, int *route_end_index) {
+	for(int i = *route_end_index + 1; i < buffer_size; ++i) {
+		if(buffer[i] == '\n' || buffer[i] == '\r') {
+			if(i - *route_end_index - 1 == 8
+				&& buffer[i - 8] == 'H'
+				&& buffer[i - 7] == 'T'
+				&& buffer[i - 6] == 'T'
+				&& buffer[i - 5] == 'P'
+				&& buffer[i - 4] == '/'
+				&& buffer[i - 3] == '1'
+				&& buffer[i - 2] == '.') {
+
+				if(buffer[i - 1] == '0') {
+					return HTTP_1_0;
+				} else if(buffer[i - 1] == '1') {
+					return HTTP_1_1;
+				}
+				return UNKNOWN_VERSION;
+			} else if(i - *route_end_index - 1 == 6
+				&& buffer[i - 6] == 'H'
+				&& buffer[i - 5] == 'T'
+				&& buffer[i - 4] == 'T'
+				&& buffer[i - 3] == 'P'
+				&& buffer[i - 2] == '/'
+				&& buffer[i - 1] == '2') {
+				return HTTP_2;
+			} else {
+				return UNKNOWN_VERSION;
+			}
+		}
+	}
+	return UNKNOWN_VERSION;
+}
+
+bool old_extract_header(char * buffer, int buffer_size, const char * name, int *value_begin_index, int *value_end_index) {
+	int name_len = strlen(name);
+	int line_begin = 0;
+
+	while(line_begin < buffer_size && buffer[line_begin] != '\n') {
+		++line_begin;
+	}
+	++line_begin;
+
+	while(line_begin < buffer_size) {
+		int line_end = line_begin;
+		while(line_end < buffer_size && buffer[line_end] != '\n') {
+			++line_end;
+		}
+
+		int content_end = line_end;
+		if(content_end > line_begin && buffer[content_end - 1] == '\r') {
+			--content_end;
+		}
+
+		if(content_end == line_begin) {
+			return false;
+		}
+
+		if(content_end - line_begin > name_len
+			&& buffer[line_begin + name_len] == ':'
+			&& strncasecmp(buffer + line_begin, name, name_len) == 0) {
+
+			int i = line_begin + name_len + 1;
+			while(i < content_end && (buffer[i] == ' ' || buffer[i] == '\t')) {
+				++i;
+			}
+			int j = content_end;
+			while(j > i && (buffer[j - 1] == ' ' || buffer[j - 1] == '\t')) {
+				--j;
+			}
+			*value_begin_index = i;
+			*value_end_index = j;
+			return true;
+		}
+
+		line_begin = line_end + 1;
+	}
+
+	return false;
+}
+
+int old_find_header_end(char * buffer, size_t buffer_size) {
+	for(size_t i = 0; i < buffer_size; ++i) {
+		if(buffer[i] != '\n') {
+			continue;
+		}
+		if(i + 1 >= buffer_size) {
+			break;
+		}
+		if(buffer[i + 1] == '\n') {
+			return i + 2;
+		}
+		if(buffer[i + 1] == '\r') {
+			if(i + 2 >= buffer_size) {
+				break;
+			}
+			if(buffer[i + 2] == '\n') {
+				return i + 3;
+			}
+		}
+	}
+	return -1;
+}
+
+/*
+	WORKLOAD
+*/
+char const * const lookups[] = {"Transfer-Encoding", "Content-Length", "Connection", "Accept-Encoding",
+	"If-None-Match", "If-Modified-Since", "Range"};
+const header_id lookup_ids[] = {HEADER_TRANSFER_ENCODING, HEADER_CONTENT_LENGTH, HEADER_CONNECTION, HEADER_ACCEPT_ENCODING,
+	HEADER_IF_NONE_MATCH, HEADER_IF_MODIFIED_SINCE, HEADER_RANGE};
+const int lookups_count = sizeof(lookups) / sizeof(lookups[0]);
+
+// Returns a checksum of everything found, so both parsers can be compared and nothing is optimized out
+size_t parse_old(char * buffer, size_t buffer_size) {
+	int header_size = old_find_header_end(buffer, buffer_size);
+	int method_last_index = 0;
+	int route_begin_index = 0;
+	int route_end_index = -1;
+	size_t sum = header_size + old_extract_method(buffer, header_size, &method_last_index);
+	old_extract_route(buffer, header_size, &method_last_index, &route_begin_index, &route_end_index);
+	sum += route_end_index + old_extract_http_version(buffer, header_size, &route_end_index);
+	for(int k = 0; k < lookups_count; ++k) {
+		int value_begin_index = 0;
+		int value_end_index = 0;
+		if(old_extract_header(buffer, header_size, lookups[k], &value_begin_index, &value_end_index)) {
+			sum += value_begin_index * 31 + value_end_index;
+		}
+	}
+	char * file_path = old_extract_file_path(buffer, &route_begin_index, &route_end_index);
+	sum += strlen(file_path);
+	delete[] file_path;
+	return sum;
+}
+
+size_t parse_new(char * buffer, size_t buffer_size) {
+	http_parser_t parser;
+	http_parser_reset(parser);
+	http_parse(parser, buffer, buffer_size);
+	const http_request_t &request = parser.request;
+	size_t sum = parser.header_end + request._method + (request.target.data + request.target.size - buffer) + request._http_version;
+	for(int k = 0; k < lookups_count; ++k) {
+		const string_view_t &value = request.headers[lookup_ids[k]];
+		if(value.data) {
+			sum += (value.data - buffer) * 31 + (value.data + value.size - buffer);
+		}
+	}
+	sum += request.path.size;
+	return sum;
+}
+
+struct request_set_t {
+	const char * name;
+	const char * request;
+};
+
+request_set_t request_sets[] = {
+	{"curl", "GET /index.html HTTP/1.1\r\n"
+		"Host: localhost:11777\r\n"
+		"User-Agent: curl/7.88.1\r\n"
+		"Accept: */*\r\n"
+		"\r\n"},
+	{"tank", "GET /js/script.js HTTP/1.1\r\n"
+		"Host: host.docker.internal:11777\r\n"
+		"User-Agent: tank\r\n"
+		"Accept: */*\r\n"
+		"Connection: Keep-Alive\r\n"
+		"\r\n"},
+	{"browser", "GET /img/logo.png?v=20240105 HTTP/1.1\r\n"
+		"Host: www.example.com\r\n"
+		"Connection: keep-alive\r\n"
+		"sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+		"sec-ch-ua-mobile: ?0\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+		"sec-ch-ua-platform: \"Linux\"\r\n"
+		"Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Dest: image\r\n"
+		"Referer: https://www.example.com/catalog/shoes/running?page=2&sort=price\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Accept-Language: ru-RU,ru;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+		"Cookie: _ga=GA1.1.1842137523.1704441600; _ym_uid=1704441601123456789; _ym_d=1704441601; "
+			"session=eyJ1c2VyIjoxMjM0NSwicm9sZSI6ImN1c3RvbWVyIiwiZXhwIjoxNzA0NTI4MDAwfQ.c2lnbmF0dXJl; "
+			"cart=3f9a0c2e-7b1d-4e8a-9c55-1a2b3c4d5e6f; _ga_XYZ=GS1.1.1704441600.3.1.1704443400.0.0.0\r\n"
+		"If-None-Match: \"1704441600.000000000-12345\"\r\n"
+		"If-Modified-Since: Fri, 05 Jan 2024 08:00:00 GMT\r\n"
+		"\r\n"},
+};
+
+double measure(char * buffer, size_t buffer_size, bool old, size_t &sum) {
+	const int iterations = 2000000;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	for(int n = 0; n < iterations; ++n) {
+		sum += old ? parse_old(buffer, buffer_size) : parse_new(buffer, buffer_size);
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - begin).count() / iterations;
+}
+
+int main() {
+	scanner_init();
+	cout << "detected scanner = " << scanner_name << endl;
+
+	struct {
+		const char * name;
+		scan_bytes_function function;
+		bool supported;
+	} scanners[] = {
+		{"scalar", scan_bytes_scalar, true},
+#ifdef SCANNER_X86
+		{"sse2", scan_bytes_sse2, __builtin_cpu_supports("sse2") != 0},
+		{"avx2", scan_bytes_avx2, __builtin_cpu_supports("avx2") != 0},
+#endif
+	};
+
+	size_t sum = 0;
+	for(size_t s = 0; s < sizeof(request_sets) / sizeof(request_sets[0]); ++s) {
+		string request = request_sets[s].request;
+		char * buffer = &request[0];
+		size_t expected = parse_old(buffer, request.size());
+
+		cout << request_sets[s].name << " (" << request.size() << " bytes):" << endl;
+		printf("  %-10s %7.1f ns/request\n", "previous", measure(buffer, request.size(), true, sum));
+		for(size_t k = 0; k < sizeof(scanners) / sizeof(scanners[0]); ++k) {
+			if(!scanners[k].supported) {
+				continue;
+			}
+			scan_bytes = scanners[k].function;
+			if(parse_new(buffer, request.size()) != expected) {
+				cout << "  " << scanners[k].name << ": result differs from the previous parser" << endl;
+				return 1;
+			}
+			printf("  %-10s %7.1f ns/request\n", scanners[k].name, measure(buffer, request.size(), false, sum));
+		}
+	}
+	return sum == 0;
+}
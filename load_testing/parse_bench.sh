@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+# Request parsing microbenchmark: the previous byte-by-byte parser
+# against scan_bytes() with every scanner the CPU supports.
+#   ./parse_bench.sh
+cd "$(dirname "$0")"
+BROTLI=""
+if [ -f /usr/include/brotli/encode.h ]; then
+	BROTLI="-DHAVE_BROTLI -lbrotlienc"
+fi
+g++ -std=c++11 -O2 parse_bench.cpp -o parse_bench -lpthread -lz $BROTLI
+if [ $? -eq 0 ]; then
+	./parse_bench
+else
+	echo BUILD - FAILED
+fi
@@ -1,42 +1,119 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <limits.h>
+#include <linux/filter.h>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <set>
+#include <sstream>
 #include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <thread>
 #include <time.h>
+#include <type_traits>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
+#include <zlib.h>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCANNER_X86
+#endif
 
 #define VERSION "0.4.2"
 #define LOG_FILE "webserver.log"
+#define ACCESS_LOG_FILE "access.log"
 #define PID_FILE "webserver.pid"
+#define OLD_PID_FILE "webserver.pid.oldbin"
+#define LISTEN_FDS_ENV "WEBSERVER_LISTEN_FDS"    // listening sockets passed to a new binary
+#define OLD_MASTER_ENV "WEBSERVER_OLD_MASTER"    // master to stop once the new one runs
 #define MAX_EVENTS 32
 #define BUFFER_SIZE 4096
+#define SEND_CHUNK_SIZE (256 * 1024)     // file bytes written per turn of a connection
+#define RANGES_MAX 16
+#define PIPELINE_BATCH_MAX 16           // pipelined responses written with one sendmsg()
+#define MAX_HEADER_SIZE 65536
+#define MAX_BODY_SIZE 1048576
+#define CACHE_MAX_FILE_SIZE 1048576
+#define ETAG_SIZE 64
+#define ENCODINGS 3
+#define KNOWN_HEADERS 9                 // header_id values before HEADER_OTHER
+#define OTHER_HEADERS_MAX 32
+#define CONTENT_TYPES 28                // built-in MIME types, see MIME TYPES
+#define EXTENSION_SLOT_BITS 6
+#define EXTENSION_MAX 15                // longer extensions are application/octet-stream
+#define GZIP_LEVEL 9
+#define BROTLI_QUALITY 9
+
+// Message types between the master and a worker (see channel_message_t).
+// A handoff passes a client connection and says whether the worker may keep
+// it open; a cache update passes a cache blob (see STATIC FILE CACHE). A
+// worker returns a kept-alive connection to the master with a return.
+#define HANDOFF_KEEP_ALIVE 'K'
+#define HANDOFF_CLOSE 'C'
+#define CACHE_UPDATE 'U'
+#define HANDOFF_RETURN 'R'
 
 using namespace std;
 
 const auto processor_count = std::thread::hardware_concurrency();
 
-char const *header_200_text_html = "HTTP/1.0 200 OK\nServer: MultiProcessWebServer v0.1\nContent-Type: text/html\n\n";
-char const *header_200_image_png = "HTTP/1.0 200 OK\nServer: MultiProcessWebServer v0.1\nContent-Disposition: inline\nContent-Type: image/png\n\n";
-char const *header_200_text_javascript = "HTTP/1.0 200 OK\nServer: MultiProcessWebServer v0.1\nContent-Type: text/javascript\n\n";
-char const *header_200_application_octet_stream = "HTTP/1.0 200 OK\nServer: MultiProcessWebServer v0.1\nContent-Type: application/octet-stream\n\n";
-char const *header_200_application_json = "HTTP/1.0 200 OK\nServer: MultiProcessWebServer v0.1\nContent-Type: application/json;charset=UTF-8\n\n";
+/*
+	Pre-rendered response headers, up to Content-Length. Their sizes are known
+	at compile time, so building a response header is a few memcpy's.
+*/
+struct header_t {
+	char const *data;
+	size_t size;
+};
+
+#define HEADER(text) { text, sizeof(text) - 1 }
+#define SERVER_LINE "Server: MultiProcessWebServer v0.1\r\n"
+
+header_t const header_200_application_json = HEADER("HTTP/1.1 200 OK\r\n" SERVER_LINE "Content-Type: application/json;charset=UTF-8\r\n");
+header_t const header_200_text_plain_metrics = HEADER("HTTP/1.1 200 OK\r\n" SERVER_LINE "Content-Type: text/plain; version=0.0.4\r\n");
 
 char const *body_not_implemented = "<b>Not implemented</b>";
 
-char const *header_400 = "HTTP/1.0 400 Bad Request \nServer: MultiProcessWebServer v0.1\nConnection: Close\nContent-Type: text/html\n\n";
-char const *body_400 = "<em>Bad request!</em>";
+header_t const header_400 = HEADER("HTTP/1.1 400 Bad Request\r\n" SERVER_LINE "Content-Type: text/html\r\n");
+header_t const body_400 = HEADER("<em>Bad request!</em>");
+
+header_t const header_206 = HEADER("HTTP/1.1 206 Partial Content\r\n" SERVER_LINE);
+
+header_t const header_304 = HEADER("HTTP/1.1 304 Not Modified\r\n" SERVER_LINE);
 
-char const *header_404 = "HTTP/1.0 404 Not Found\nServer: MultiProcessWebServer v0.1\nContent-Type: text/html\n\n";
+header_t const header_404 = HEADER("HTTP/1.1 404 Not Found\r\n" SERVER_LINE "Content-Type: text/html\r\n");
+
+header_t const header_416 = HEADER("HTTP/1.1 416 Range Not Satisfiable\r\n" SERVER_LINE);
+
+header_t const connection_keep_alive = HEADER("Connection: keep-alive\r\n\r\n");
+header_t const connection_close = HEADER("Connection: close\r\n\r\n");
 
 char const *root_directory = "/";
 
@@ -44,29 +121,359 @@ char const *default_page = "/index.html";
 
 char const *route_calc = "/calc";
 
-static std::ofstream log (LOG_FILE);
+char const *route_stats = "/stats";
+
+char const *route_metrics = "/metrics";
+
+/*
+	LOGGING
+
+	log_error / log_warn / log_info / log_debug << ... << endl;
+
+	A line is formatted on the stack and copied into a lock-free ring owned
+	by the calling thread. A background thread of every process batches all
+	rings into the log file with one writev() every LOG_FLUSH_INTERVAL_MS.
+	Lines above LOG_MAX_LEVEL (a build flag) compile to nothing, lines above
+	log_level (-l) cost one comparison. A full ring drops lines instead of
+	blocking the caller. SIGUSR1 reopens the log file, e.g. after rotation.
+
+	The access log (see ACCESS LOG) goes through the same rings and flusher
+	as a second sink.
+*/
+enum log_level_t {LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG};
+
+enum log_sink_t {LOG_SINK_MAIN, LOG_SINK_ACCESS, LOG_SINKS};
+
+const char * const log_files[LOG_SINKS] = {LOG_FILE, ACCESS_LOG_FILE};
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_LINE_SIZE 4096
+#define LOG_RING_SIZE (1 << 20)
+#define LOG_FLUSH_INTERVAL_MS 50
+
+#define LOG_AT(level) if((level) > LOG_MAX_LEVEL || (level) > log_level) ; else log_line_t()
+#define log_error LOG_AT(LOG_ERROR)
+#define log_warn LOG_AT(LOG_WARN)
+#define log_info LOG_AT(LOG_INFO)
+#define log_debug LOG_AT(LOG_DEBUG)
+
+int log_level = LOG_INFO;
+
+volatile sig_atomic_t log_reopen_requested = 0;
+
+/*
+	Single-producer single-consumer byte ring: the owning thread moves head,
+	the flusher moves tail
+*/
+struct log_ring_t {
+	int sink;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+	std::atomic<size_t> dropped;
+	char data[LOG_RING_SIZE];
+};
+
+struct logger_t {
+	std::mutex rings_mutex;     // guards rings
+	std::mutex flush_mutex;     // one flush at a time
+	vector<log_ring_t *> rings;
+	int fds[LOG_SINKS];
+};
+
+// Never freed: the flusher thread may outlive static destructors
+logger_t *logger = new logger_t();
+
+thread_local log_ring_t *log_thread_rings[LOG_SINKS];
+
+log_ring_t *log_register_ring(int sink) {
+	log_ring_t *ring = new log_ring_t();
+	ring->sink = sink;
+	std::lock_guard<std::mutex> lock(logger->rings_mutex);
+	logger->rings.push_back(ring);
+	log_thread_rings[sink] = ring;
+	return ring;
+}
+
+void log_commit(int sink, const char *line, size_t size) {
+	log_ring_t *ring = log_thread_rings[sink] ? log_thread_rings[sink] : log_register_ring(sink);
+
+	size_t head = ring->head.load(std::memory_order_relaxed);
+	size_t tail = ring->tail.load(std::memory_order_acquire);
+
+	if(LOG_RING_SIZE - (head - tail) < size) {
+		ring->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	size_t position = head & (LOG_RING_SIZE - 1);
+	size_t first = min(size, (size_t)LOG_RING_SIZE - position);
+	memcpy(ring->data + position, line, first);
+	memcpy(ring->data, line + first, size - first);
+
+	ring->head.store(head + size, std::memory_order_release);
+}
+
+class log_line_t {
+public:
+	log_line_t() : size(0) {}
+
+	~log_line_t() {
+		while(size > 0 && buffer[size - 1] == '\n') {
+			--size;
+		}
+		buffer[size++] = '\n';
+		log_commit(LOG_SINK_MAIN, buffer, size);
+	}
+
+	log_line_t &write(const char *data, size_t data_size) {
+		data_size = min(data_size, (size_t)LOG_LINE_SIZE - 1 - size);
+		memcpy(buffer + size, data, data_size);
+		size += data_size;
+		return *this;
+	}
+
+	log_line_t &operator<<(const char *text) {
+		return write(text, strlen(text));
+	}
+
+	log_line_t &operator<<(const string &text) {
+		return write(text.data(), text.size());
+	}
+
+	log_line_t &operator<<(char c) {
+		return write(&c, 1);
+	}
+
+	template<typename T>
+	typename std::enable_if<std::is_integral<T>::value, log_line_t &>::type operator<<(T value) {
+		char digits[24];
+		int digits_size = std::is_signed<T>::value
+			? snprintf(digits, sizeof(digits), "%lld", (long long)value)
+			: snprintf(digits, sizeof(digits), "%llu", (unsigned long long)value);
+		return write(digits, digits_size);
+	}
+
+	// endl: every line ends with a newline anyway
+	log_line_t &operator<<(std::ostream &(*)(std::ostream &)) {
+		return *this;
+	}
+
+private:
+	char buffer[LOG_LINE_SIZE];
+	size_t size;
+};
+
+void log_open(int sink, bool truncate) {
+	int fd = open(log_files[sink], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+	if(fd == -1) {
+		return;
+	}
+	int old_fd = logger->fds[sink];
+	logger->fds[sink] = fd;
+	if(old_fd != -1) {
+		close(old_fd);
+	}
+}
+
+void log_flush() {
+	std::lock_guard<std::mutex> flush_lock(logger->flush_mutex);
+
+	if(log_reopen_requested) {
+		log_reopen_requested = 0;
+		for(int sink = 0; sink < LOG_SINKS; ++sink) {
+			if(logger->fds[sink] != -1) {
+				log_open(sink, false);
+			}
+		}
+	}
+
+	vector<log_ring_t *> rings;
+	{
+		std::lock_guard<std::mutex> lock(logger->rings_mutex);
+		rings = logger->rings;
+	}
+
+	vector<struct iovec> iov[LOG_SINKS];
+	vector<size_t> heads(rings.size());
+	string dropped_lines;
+
+	for(int i = 0; i < rings.size(); ++i) {
+		log_ring_t *ring = rings[i];
+		size_t head = ring->head.load(std::memory_order_acquire);
+		size_t tail = ring->tail.load(std::memory_order_relaxed);
+		heads[i] = head;
+
+		if(head != tail) {
+			size_t position = tail & (LOG_RING_SIZE - 1);
+			size_t first = min(head - tail, (size_t)LOG_RING_SIZE - position);
+			struct iovec part;
+			part.iov_base = ring->data + position;
+			part.iov_len = first;
+			iov[ring->sink].push_back(part);
+			if(first < head - tail) {
+				part.iov_base = ring->data;
+				part.iov_len = head - tail - first;
+				iov[ring->sink].push_back(part);
+			}
+		}
+
+		size_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+		if(dropped > 0) {
+			dropped_lines += string("Log ring full, ") + to_string(dropped) + " lines dropped from " + log_files[ring->sink] + "\n";
+		}
+	}
+
+	if(!dropped_lines.empty()) {
+		struct iovec part;
+		part.iov_base = (void *)dropped_lines.data();
+		part.iov_len = dropped_lines.size();
+		iov[LOG_SINK_MAIN].push_back(part);
+	}
+
+	for(int sink = 0; sink < LOG_SINKS; ++sink) {
+		for(size_t done = 0; done < iov[sink].size(); done += IOV_MAX) {
+			if(writev(logger->fds[sink], &iov[sink][done], min(iov[sink].size() - done, (size_t)IOV_MAX)) == -1) {
+				break;
+			}
+		}
+	}
+
+	for(int i = 0; i < rings.size(); ++i) {
+		rings[i]->tail.store(heads[i], std::memory_order_release);
+	}
+}
+
+void log_flusher() {
+	while(1) {
+		usleep(LOG_FLUSH_INTERVAL_MS * 1000);
+		log_flush();
+	}
+}
+
+/*
+	Starts the flusher thread of the current process. A forked child starts
+	with the rings of its parent discarded (the parent flushes them) and
+	calls this again.
+*/
+void log_start() {
+	std::thread(log_flusher).detach();
+}
+
+void log_prepare_fork() {
+	logger->flush_mutex.lock();
+	logger->rings_mutex.lock();
+}
+
+void log_parent_after_fork() {
+	logger->rings_mutex.unlock();
+	logger->flush_mutex.unlock();
+}
+
+void log_child_after_fork() {
+	logger->rings_mutex.unlock();
+	logger->flush_mutex.unlock();
+	logger->rings.clear();
+	for(int sink = 0; sink < LOG_SINKS; ++sink) {
+		log_thread_rings[sink] = NULL;
+	}
+}
+
+/*
+	Opens the log files (the access log only when access_log is set) and
+	starts the flusher of the master. A binary started by an upgrade does
+	not truncate: the old one still writes.
+*/
+void log_init(bool access_log, bool truncate) {
+	for(int sink = 0; sink < LOG_SINKS; ++sink) {
+		logger->fds[sink] = -1;
+	}
+	log_open(LOG_SINK_MAIN, truncate);
+	if(access_log) {
+		log_open(LOG_SINK_ACCESS, false);
+	}
+	pthread_atfork(log_prepare_fork, log_parent_after_fork, log_child_after_fork);
+	atexit(log_flush);
+	log_start();
+}
+
+enum listen_mode {REUSEPORT, FDPASS};
+
+enum dispatch_policy {DISPATCH_ROUND_ROBIN, DISPATCH_LEAST_LOADED, DISPATCH_TWO_CHOICES};
+
+char const * const dispatch_names[] = {"rr", "least", "p2c"};
+
+enum io_backend_kind {IO_EPOLL, IO_URING};
+
+char const * const io_backend_names[] = {"epoll", "uring"};
+
+enum steering_mode {STEER_OFF, STEER_INCOMING_CPU, STEER_CBPF};
+
+char const * const steering_names[] = {"off", "cpu", "cbpf"};
+
+enum etag_mode {ETAG_OFF, ETAG_STRONG, ETAG_WEAK};
+
+char const * const etag_names[] = {"off", "strong", "weak"};
 
 struct global_args_t {
 	string host;
 	int port;
 	string directory;
+	listen_mode mode;
+	dispatch_policy dispatch;
+	io_backend_kind io_backend;
+	int workers;                 // worker processes
+	int threads;                 // request threads per worker, 1: on the event loop thread
+	string affinity;             // -k: off, auto or a CPU list
+	steering_mode steering;
+	int keep_alive_max_requests;
+	int keep_alive_timeout;
+	size_t cache_size;
+	bool access_log;
+	etag_mode etag;
+	string cache_policy_file;    // -x: Cache-Control per extension
+	string mime_types_file;      // -f: extensions of further MIME types
+	int drain_timeout;           // seconds for graceful shutdown
+	char **argv;                 // executed again on SIGUSR2
 } global_args;
 
+/*
+	State of a persistent (keep-alive) connection
+*/
+struct keep_alive_t {
+	int requests;
+	time_t last_active;
+	uint32_t peer;      // client address for the access log
+};
+
+
 struct master_vars_t {
 	int children;
 	std::map<pid_t, int> socket_map;
 	vector<int> sockets;
+	vector<int> slots;       // metrics slot of the worker behind sockets[i]
+	vector<int> positions;   // position of the worker behind sockets[i] (see free_position)
+	vector<int> listen_sockets;
+	std::map<int, keep_alive_t> connections;
+	const char *pid_file;
+	pid_t upgrade_pid;       // the new binary being started
+	pid_t old_master;        // the master this one replaces
+	time_t drain_deadline;   // 0 when not draining
+	int epoll;
 } master_vars;
 
 void writePid(pid_t pid) {
 	FILE *f;
+	master_vars.pid_file = PID_FILE;
 	f = fopen(PID_FILE, "w+");
 	if(f){
 		fprintf(f, "%u", pid);
 		fclose(f);
-		log << "Master PID " << pid << " written" << endl;
+		log_info << "Master PID " << pid << " written" << endl;
 	} else {
-		log << "Master PID write error: " << errno << " " << strerror(errno) << endl;
+		log_error << "Master PID write error: " << errno << " " << strerror(errno) << endl;
 	}
 }
 
@@ -76,46 +483,58 @@ void demonize() {
 	if(sid < 0) {
 		cerr << "sid = " << sid << endl;
 	}
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
+	// Point the standard descriptors at /dev/null rather than closing them,
+	// otherwise sockets reuse 0-2 and stray console output lands in them
+	int null_fd = open("/dev/null", O_RDWR);
+	dup2(null_fd, STDIN_FILENO);
+	dup2(null_fd, STDOUT_FILENO);
+	dup2(null_fd, STDERR_FILENO);
+	if(null_fd > STDERR_FILENO) {
+		close(null_fd);
+	}
 }
 
-void masterSignalHandler(int sig, siginfo_t *si, void *ptr) {
-	log << "Master caught signal: " << strsignal(sig) << endl;
-
-	int status;
-	pid_t pid;
-	if(sig == SIGCHLD) {
-		log << "SIGCHLD caught from Process #" << si->si_pid << endl;
-		while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-			log << "Child " << pid << " terminated with status " << status << endl;
-
-			std::map<pid_t, int>::iterator it;
-			it = master_vars.socket_map.find(pid);
-			if(it != master_vars.socket_map.end()) {
-				master_vars.socket_map.erase(it);
-				log << "Writing socket " << it->second << " deleted from map" << endl;
-
-
-				int index = -1;
-				for(int i = 0; i < master_vars.sockets.size(); ++i) {
-					if(master_vars.sockets[i] == it->second) {
-						index = i;
-						break;
-					}
-				}
+volatile sig_atomic_t child_exited = 0;
+volatile sig_atomic_t log_reopen_forward = 0;
+volatile sig_atomic_t drain_requested = 0;
+volatile sig_atomic_t upgrade_requested = 0;
 
-				if(index != -1) {
-					master_vars.sockets.erase(master_vars.sockets.begin() + index);
-					log << "Writing socket " << it->second << " deleted from vector" << endl;
-				}
-				--master_vars.children;
-			}
+/*
+	Only raises flags: the master loop reaps children, forwards the log
+	reopen request, drains (SIGTERM) and upgrades (SIGUSR2) outside of the
+	handler. Workers inherit this handler and drain on SIGTERM too.
+*/
+void masterSignalHandler(int sig, siginfo_t *si, void *ptr) {
+	switch(sig) {
+		case SIGCHLD: {
+			child_exited = 1;
+			break;
+		}
+		case SIGUSR1: {
+			log_reopen_requested = 1;
+			log_reopen_forward = 1;
+			break;
+		}
+		case SIGTERM: {
+			drain_requested = 1;
+			break;
+		}
+		case SIGUSR2: {
+			upgrade_requested = 1;
+			break;
 		}
 	}
 }
 
+/*
+	Responses are written whole (or corked with MSG_MORE), so Nagle's
+	algorithm only delays the last segment of a response
+*/
+void set_nodelay(int fd) {
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
 int set_nonblock(int fd) {
 	int flags;
 	#if defined(O_NONBLOCK)
@@ -130,71 +549,95 @@ int set_nonblock(int fd) {
 
 enum method {POST, GET, UNKNOWN};
 
+char const * const method_names[] = {"POST", "GET", "-"};
+
 enum http_version {HTTP_1_0, HTTP_1_1, HTTP_2, UNKNOWN_VERSION};
 
-enum content_type {HTML, JS, PNG, OCTET_STREAM};
+// Built-in types; types named only in the -f file get values from CONTENT_TYPES on
+enum content_type : int {HTML, CSS, JS, JSON, XML, TEXT, CSV, SVG, PNG, JPEG, GIF, WEBP, AVIF, ICO, WOFF, WOFF2, TTF, OTF,
+	PDF, WASM, MP4, WEBM, MP3, OGG, WAV, MANIFEST, ZIP, OCTET_STREAM};
 
-method extract_method(char * buffer, int buffer_size, int *method_last_index) {
+enum content_encoding {ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BR};
 
-	for(int p = 0; p < buffer_size; ++p) {
-		if(buffer[p] == ' ') {
-			if(p == 4 && buffer[0] == 'P' && buffer[1] == 'O' && buffer[2] == 'S' && buffer[3] == 'T') {
-				*method_last_index = p;
-				return POST;
-			} else if (p == 3 && buffer[0] == 'G' && buffer[1] == 'E' && buffer[2] == 'T') {
-				*method_last_index = p;
-				return GET;
-			} else {
-				return UNKNOWN;
-			}
-		}
-	}
+char const * const encoding_names[ENCODINGS] = {"identity", "gzip", "br"};
+char const * const encoding_suffixes[ENCODINGS] = {"", ".gz", ".br"};   // precompressed sidecar files
 
-	return UNKNOWN;
-}
+/*
+	BYTE SCANNER
 
-void extract_route(char * buffer, int buffer_size, int *method_last_index, int *route_begin_index, int *route_end_index) {
-	*route_begin_index = *method_last_index + 1;
-	for(int i = *route_begin_index + 1; i < buffer_size; ++i) {
-		if(buffer[i] == ' ') {
-			*route_end_index = i;
-			break;
+	The parser looks for a few delimiters (space, '?', CR, LF) in the request.
+	scan_bytes(p, end, a, b) returns the first position in [p, end) holding
+	a or b, or end. scanner_init() picks the widest version the CPU runs:
+	AVX2 compares 32 bytes per step, SSE2 16, other CPUs take the byte loop.
+	Loads never go past end; the last partial block is done byte by byte.
+*/
+const char *scan_bytes_scalar(const char *p, const char *end, char a, char b) {
+	for(; p < end; ++p) {
+		if(*p == a || *p == b) {
+			return p;
 		}
 	}
+	return end;
 }
 
-char * extract_file_path(char * buffer, int *route_begin_index, int *route_end_index) {
-	int index = *route_end_index;
-
-	for(int i = *route_begin_index; i < *route_end_index; ++i) {
-		if(buffer[i] == '?') {
-			index = i;
-			break;
+#ifdef SCANNER_X86
+__attribute__((target("sse2")))
+const char *scan_bytes_sse2(const char *p, const char *end, char a, char b) {
+	__m128i first = _mm_set1_epi8(a);
+	__m128i second = _mm_set1_epi8(b);
+	for(; end - p >= 16; p += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)p);
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, first), _mm_cmpeq_epi8(block, second)));
+		if(mask != 0) {
+			return p + __builtin_ctz(mask);
 		}
 	}
+	return scan_bytes_scalar(p, end, a, b);
+}
 
-	char * filePath = new char[index - *route_begin_index + 1];
-	int i = 0;
-	for(i = *route_begin_index; i < index; ++i) {
-		filePath[i - *route_begin_index] = buffer[i];
+__attribute__((target("avx2")))
+const char *scan_bytes_avx2(const char *p, const char *end, char a, char b) {
+	__m256i first = _mm256_set1_epi8(a);
+	__m256i second = _mm256_set1_epi8(b);
+	for(; end - p >= 32; p += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)p);
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, first), _mm256_cmpeq_epi8(block, second)));
+		if(mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
 	}
-	filePath[i - *route_begin_index] = '\0';
-	return filePath;
+	// the tail runs SSE code: clear the upper halves first, or every SSE instruction pays the transition
+	_mm256_zeroupper();
+	return scan_bytes_sse2(p, end, a, b);
 }
-
-inline bool file_exists (const std::string& filename) {
-  struct stat buffer;
-  return (stat (filename.c_str(), &buffer) == 0 && S_ISREG(buffer.st_mode));
+#endif
+
+typedef const char *(*scan_bytes_function)(const char *p, const char *end, char a, char b);
+
+scan_bytes_function scan_bytes = scan_bytes_scalar;
+char const *scanner_name = "scalar";
+
+void scanner_init() {
+#ifdef SCANNER_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		scan_bytes = scan_bytes_avx2;
+		scanner_name = "avx2";
+	} else if(__builtin_cpu_supports("sse2")) {
+		scan_bytes = scan_bytes_sse2;
+		scanner_name = "sse2";
+	}
+#endif
 }
 
-int calc(char * buffer, int *body_begin_index) {
+int calc(char * buffer, int buffer_size, int *body_begin_index) {
 	char state = '^';
 	char op = '+';
 
 	int num1 = 0;
 	int num2 = 0;
 
-	for(int i = *body_begin_index; i < strlen(buffer); ++i) {
+	for(int i = *body_begin_index; i < buffer_size; ++i) {
 		char cur = buffer[i];
 		switch(state) {
 			case '^': {
@@ -256,483 +699,5682 @@ int calc(char * buffer, int *body_begin_index) {
 	return 0;
 }
 
-void extract_body(char * buffer, int buffer_size, int *body_begin_index) {
-	for(int i = 3; i < buffer_size; ++i) {
-		if(*body_begin_index == -1 && buffer[i - 1] == '\n' && buffer[i - 2] == '\r' && buffer[i - 3] == '\n') {
-			*body_begin_index = i;
+/*
+	REQUEST
+
+	When the header is complete, http_parse() indexes the request once.
+	The fields are views into the connection buffer: nothing is copied,
+	and they stay valid until the request is erased from conn.input.
+
+	The headers the server reads have fixed slots in headers[].
+	lookup_header() picks the slot from the name length, which only
+	Transfer-Encoding and If-Modified-Since share (they differ in the
+	first letter), and confirms it with one comparison. Other headers go
+	to a small inline array. Past OTHER_HEADERS_MAX they are not indexed.
+*/
+struct string_view_t {
+	const char *data;   // NULL: absent
+	int size;
+};
+
+enum header_id {HEADER_HOST, HEADER_CONNECTION, HEADER_CONTENT_LENGTH, HEADER_TRANSFER_ENCODING, HEADER_ACCEPT_ENCODING,
+	HEADER_IF_NONE_MATCH, HEADER_IF_MODIFIED_SINCE, HEADER_RANGE, HEADER_IF_RANGE, HEADER_OTHER};
+
+char const * const header_names[KNOWN_HEADERS] = {"Host", "Connection", "Content-Length", "Transfer-Encoding", "Accept-Encoding",
+	"If-None-Match", "If-Modified-Since", "Range", "If-Range"};
+
+struct request_header_t {
+	string_view_t name;
+	string_view_t value;
+};
+
+struct http_request_t {
+	const char *buffer;         // the views point into it
+	method _method;
+	string_view_t target;       // path and query as sent
+	string_view_t path;
+	string_view_t query;        // after '?'; data is NULL without one
+	http_version _http_version;
+	string_view_t headers[KNOWN_HEADERS];   // trimmed value of the first occurrence
+	request_header_t other_headers[OTHER_HEADERS_MAX];
+	int other_headers_count;
+};
+
+header_id lookup_header(const char *name, int size) {
+	header_id id;
+	switch(size) {
+		case 4: {
+			id = HEADER_HOST;
 			break;
 		}
-	}
-}
-
-content_type get_content_type(const char * filename) {
-	cout << "get_content_type = " << filename << endl;
-	int len = strlen(filename);
-	for(int i = len - 1; i >=0; --i) {
-		if(filename[i] == '.') {
-			switch(len - i - 1) {
-				case 2: {
-					if(filename[i + 1] == 'j' && filename[i + 2] == 's') {
-						return JS;
-					}
-					break;
-				}
-				case 3: {
-					if(filename[i + 1] == 'p' && filename[i + 2] == 'n' && filename[i + 3] == 'g') {
-						return PNG;
-					}
-					break;
-				}
-				case 4: {
-					if(filename[i + 1] == 'h' && filename[i + 2] == 't' && filename[i + 3] == 'm' && filename[i + 4] == 'l') {
-						return HTML;
-					}
-					break;
-				}
-			}
+		case 5: {
+			id = HEADER_RANGE;
+			break;
+		}
+		case 8: {
+			id = HEADER_IF_RANGE;
+			break;
+		}
+		case 10: {
+			id = HEADER_CONNECTION;
 			break;
 		}
+		case 13: {
+			id = HEADER_IF_NONE_MATCH;
+			break;
+		}
+		case 14: {
+			id = HEADER_CONTENT_LENGTH;
+			break;
+		}
+		case 15: {
+			id = HEADER_ACCEPT_ENCODING;
+			break;
+		}
+		case 17: {
+			id = (name[0] == 'T' || name[0] == 't') ? HEADER_TRANSFER_ENCODING : HEADER_IF_MODIFIED_SINCE;
+			break;
+		}
+		default: {
+			return HEADER_OTHER;
+		}
 	}
-	return OCTET_STREAM;
-}
-
-http_version extract_http_version(char * buffer, int buffer_size, int *route_end_index) {
-	for(int i = *route_end_index + 1; i < buffer_size; ++i) {
-		if(buffer[i] == '\n' || buffer[i] == '\r') {
-			if(i - *route_end_index - 1 == 8
-				&& buffer[i - 8] == 'H'
-				&& buffer[i - 7] == 'T'
-				&& buffer[i - 6] == 'T'
-				&& buffer[i - 5] == 'P'
-				&& buffer[i - 4] == '/'
-				&& buffer[i - 3] == '1'
-				&& buffer[i - 2] == '.') {
-
-				if(buffer[i - 1] == '0') {
-					return HTTP_1_0;
-				} else if(buffer[i - 1] == '1') {
-					return HTTP_1_1;
-				}
-				return UNKNOWN_VERSION;
-			} else if(i - *route_end_index - 1 == 6
-				&& buffer[i - 6] == 'H'
-				&& buffer[i - 5] == 'T'
-				&& buffer[i - 4] == 'T'
-				&& buffer[i - 3] == 'P'
-				&& buffer[i - 2] == '/'
-				&& buffer[i - 1] == '2') {
-				return HTTP_2;
-			} else {
-				return UNKNOWN_VERSION;
-			}
+	return strncasecmp(name, header_names[id], size) == 0 ? id : HEADER_OTHER;
+}
+
+http_version parse_http_version(const char *version, const char *version_end) {
+	int size = version_end - version;
+	if(size == 8 && memcmp(version, "HTTP/1.", 7) == 0) {
+		if(version[7] == '0') {
+			return HTTP_1_0;
+		} else if(version[7] == '1') {
+			return HTTP_1_1;
 		}
+	} else if(size == 6 && memcmp(version, "HTTP/2", 6) == 0) {
+		return HTTP_2;
 	}
 	return UNKNOWN_VERSION;
 }
 
-ssize_t sock_fd_write(int socket, void *buf, ssize_t buflen, int fd) {
-	log << "sock_fd_write: socket = " << socket << ", fd = " << fd << endl; 
-	ssize_t size;
-	struct msghdr msg;
-	struct iovec iov;
+/*
+	"METHOD target version" up to line_end. Returns false for an unknown
+	method or a line without a target.
+*/
+bool parse_request_line(http_request_t &request, const char *line, const char *line_end) {
+	const char *method_end = scan_bytes(line, line_end, ' ', ' ');
+	int method_size = method_end - line;
+	if(method_size == 4 && memcmp(line, "POST", 4) == 0) {
+		request._method = POST;
+	} else if(method_size == 3 && memcmp(line, "GET", 3) == 0) {
+		request._method = GET;
+	} else {
+		return false;
+	}
 
-	union {
-		struct cmsghdr cmsghdr;
-		char control[CMSG_SPACE(sizeof(int))];
-	} cmsgu;
+	const char *target = method_end + 1;
+	if(target + 1 >= line_end) {
+		return false;
+	}
+	const char *target_end = scan_bytes(target + 1, line_end, ' ', ' ');
+	if(target_end == line_end) {
+		return false;
+	}
+	request.target.data = target;
+	request.target.size = target_end - target;
+
+	const char *path_end = scan_bytes(target, target_end, '?', '?');
+	request.path.data = target;
+	request.path.size = path_end - target;
+	if(path_end < target_end) {
+		request.query.data = path_end + 1;
+		request.query.size = target_end - path_end - 1;
+	}
 
-	struct cmsghdr * cmsg;
+	request._http_version = parse_http_version(target_end + 1, line_end);
+	return true;
+}
 
-	iov.iov_base = buf;
-	iov.iov_len = buflen;
+void index_headers(http_request_t &request, const char *p, const char *end) {
+	while(p < end) {
+		const char *line_end = scan_bytes(p, end, '\n', '\n');
+		const char *content_end = line_end;
+		if(content_end > p && content_end[-1] == '\r') {
+			--content_end;
+		}
+		if(content_end == p) {
+			// empty line - end of headers
+			return;
+		}
 
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+		const char *colon = scan_bytes(p, content_end, ':', ':');
+		if(colon > p && colon < content_end) {
+			const char *value = colon + 1;
+			while(value < content_end && (*value == ' ' || *value == '\t')) {
+				++value;
+			}
+			const char *value_end = content_end;
+			while(value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+				--value_end;
+			}
 
-	if(fd != -1) {
-		msg.msg_control = cmsgu.control;
-		msg.msg_controllen = sizeof(cmsgu.control);
-		cmsg = CMSG_FIRSTHDR(&msg);
-		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-		cmsg->cmsg_level = SOL_SOCKET;
-		cmsg->cmsg_type = SCM_RIGHTS;
-		*((int *)CMSG_DATA(cmsg)) = fd;
-	} else {
-		msg.msg_control = NULL;
-		msg.msg_controllen = 0;
-		log << "Not passing fd" << endl;
-	}
+			header_id id = lookup_header(p, colon - p);
+			string_view_t *slot = NULL;
+			if(id != HEADER_OTHER) {
+				slot = request.headers[id].data ? NULL : &request.headers[id];
+			} else if(request.other_headers_count < OTHER_HEADERS_MAX) {
+				request_header_t &header = request.other_headers[request.other_headers_count++];
+				header.name.data = p;
+				header.name.size = colon - p;
+				slot = &header.value;
+			}
+			if(slot) {
+				slot->data = value;
+				slot->size = value_end - value;
+			}
+		}
 
-	size = sendmsg(socket, &msg, 0); 
-	if(size == -1) {
-		log << "Sendmsg error: " << errno << endl;
-		log << strerror(errno) << endl;
-	} else {
-		log << "sendmsg: OK. Socket " << socket << ", fd " << fd << " with size " << size << endl;
+		p = line_end + 1;
 	}
-	return size;
 }
 
-ssize_t sock_fd_read(int socket, void * buf, ssize_t bufsize, int *fd) {
-	ssize_t size;
+/*
+	Indexes the header buffer[0..header_size). Returns false if the
+	request line is not valid.
+*/
+bool http_request_index(http_request_t &request, const char *buffer, int header_size) {
+	request.buffer = buffer;
+	request._method = UNKNOWN;
+	request.query.data = NULL;
+	request.query.size = 0;
+	request._http_version = UNKNOWN_VERSION;
+	memset(request.headers, 0, sizeof(request.headers));
+	request.other_headers_count = 0;
+
+	const char *end = buffer + header_size;
+	const char *line_end = scan_bytes(buffer, end, '\n', '\r');
+	if(!parse_request_line(request, buffer, line_end)) {
+		return false;
+	}
+	index_headers(request, scan_bytes(line_end, end, '\n', '\n') + 1, end);
+	return true;
+}
 
-	if(fd) {
-		struct msghdr msg;
-		struct iovec iov;
+bool view_equals(const string_view_t &view, const char * text) {
+	return view.size == (int)strlen(text) && memcmp(view.data, text, view.size) == 0;
+}
 
-		union {
-			struct cmsghdr cmsghdr;
-			char control[CMSG_SPACE(sizeof(int))];
-		} cmsgu;
+bool header_value_contains(const string_view_t &value, const char * token) {
+	int token_len = strlen(token);
+	for(int i = 0; i + token_len <= value.size; ++i) {
+		if(strncasecmp(value.data + i, token, token_len) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
 
-		struct cmsghdr * cmsg;
+/*
+	HTTP/1.1 connections are persistent unless "Connection: close" is sent,
+	HTTP/1.0 ones only with "Connection: keep-alive"
+*/
+bool is_keep_alive(const http_request_t &request) {
+	const string_view_t &connection = request.headers[HEADER_CONNECTION];
 
-		iov.iov_base = buf;
-		iov.iov_len = bufsize;
+	switch(request._http_version) {
+		case HTTP_1_1: {
+			return !header_value_contains(connection, "close");
+		}
+		case HTTP_1_0: {
+			return header_value_contains(connection, "keep-alive");
+		}
+		default: {
+			return false;
+		}
+	}
+}
 
-		msg.msg_name = NULL;
-		msg.msg_namelen = 0;
-		msg.msg_iov = &iov;
-		msg.msg_iovlen = 1;
+/*
+	Resumable request parser. The header terminator is searched only in bytes
+	that were not scanned before, so a request split into many segments is
+	still parsed in linear time. The request is indexed once, when the
+	terminator is found.
+*/
+enum parse_result {PARSE_AGAIN, PARSE_DONE, PARSE_ERROR};
+
+struct http_parser_t {
+	size_t scan_offset;  // next byte to look at for the end of the header
+	int header_end;      // first byte after the empty line, -1 until it is found
+	size_t request_end;  // header_end + Content-Length
+	http_request_t request;
+};
+
+void http_parser_reset(http_parser_t &parser) {
+	parser.scan_offset = 0;
+	parser.header_end = -1;
+	parser.request_end = 0;
+}
 
-		msg.msg_control = cmsgu.control;
-		msg.msg_controllen = sizeof(cmsgu.control);
+parse_result http_parse(http_parser_t &parser, char * buffer, size_t buffer_size) {
+	if(parser.header_end == -1) {
+		size_t i = parser.scan_offset;
+		for(; i < buffer_size; ++i) {
+			i = scan_bytes(buffer + i, buffer + buffer_size, '\n', '\n') - buffer;
+			if(i == buffer_size) {
+				break;
+			}
+			if(i + 1 >= buffer_size) {
+				break;
+			}
+			if(buffer[i + 1] == '\n') {
+				parser.header_end = i + 2;
+				break;
+			}
+			if(buffer[i + 1] == '\r') {
+				if(i + 2 >= buffer_size) {
+					break;
+				}
+				if(buffer[i + 2] == '\n') {
+					parser.header_end = i + 3;
+					break;
+				}
+			}
+		}
 
-		size = recvmsg(socket, &msg, 0);
+		if(parser.header_end == -1) {
+			parser.scan_offset = i;
+			return buffer_size > MAX_HEADER_SIZE ? PARSE_ERROR : PARSE_AGAIN;
+		}
 
-		if(size < 0) {
-			log << "recvmsg error: " << errno << endl;
-			log << strerror(errno) << endl;
-			exit(1);
+		if(!http_request_index(parser.request, buffer, parser.header_end)) {
+			return PARSE_ERROR;
 		}
 
-		cmsg = CMSG_FIRSTHDR(&msg);
+		if(parser.request.headers[HEADER_TRANSFER_ENCODING].data) {
+			// chunked bodies are not supported
+			return PARSE_ERROR;
+		}
 
-		if(cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
-			if(cmsg->cmsg_level != SOL_SOCKET) {
-				log << "Invalid cmsg_level " << cmsg->cmsg_level << endl;
-				exit(1);
+		size_t content_length = 0;
+		const string_view_t &length = parser.request.headers[HEADER_CONTENT_LENGTH];
+		if(length.data) {
+			if(length.size == 0) {
+				return PARSE_ERROR;
 			}
-			if(cmsg->cmsg_type != SCM_RIGHTS) {
-				log << "Invalid cmsg_type " << cmsg->cmsg_type << endl;
-				exit(1);
+			for(int i = 0; i < length.size; ++i) {
+				if(length.data[i] < '0' || length.data[i] > '9') {
+					return PARSE_ERROR;
+				}
+				content_length = content_length * 10 + (length.data[i] - '0');
+				if(content_length > MAX_BODY_SIZE) {
+					return PARSE_ERROR;
+				}
+			}
+		}
+
+		parser.request_end = parser.header_end + content_length;
+	}
+
+	if(buffer_size < parser.request_end) {
+		return PARSE_AGAIN;
+	}
+
+	// A body read later may have moved the buffer the request was indexed in
+	if(parser.request.buffer != buffer) {
+		http_request_index(parser.request, buffer, parser.header_end);
+	}
+	return PARSE_DONE;
+}
+
+void append_connection(string &response, bool keep_alive) {
+	header_t const &line = keep_alive ? connection_keep_alive : connection_close;
+	response.append(line.data, line.size);
+}
+
+void append_content_length(string &response, size_t content_length) {
+	char digits[24];
+	char *end = digits + sizeof(digits);
+	char *p = end;
+	do {
+		*--p = '0' + content_length % 10;
+		content_length /= 10;
+	} while(content_length > 0);
+
+	response.append("Content-Length: ", 16);
+	response.append(p, end - p);
+	response.append("\r\n", 2);
+}
+
+void append_header(string &response, header_t const &header, size_t content_length, bool keep_alive) {
+	response.append(header.data, header.size);
+	append_content_length(response, content_length);
+	append_connection(response, keep_alive);
+}
+
+/*
+	MIME TYPES
+
+	A file's Content-Type comes from its extension. The built-in table is
+	compiled in: extension_slots[] is a perfect hash of the extensions,
+	built at compile time. A lookup is one FNV-1a hash of the lowercased
+	extension, one table load and one comparison, and it allocates
+	nothing. The offset basis is picked so that no two built-in
+	extensions share a slot. A static_assert checks this when the list
+	changes; if it fails, pick another basis.
+
+	global_args.mime_types_file (-f) adds or overrides mappings. It uses
+	the mime.types format of nginx and Apache:
+
+		# type                  extensions
+		text/markdown           md markdown
+		application/javascript  js
+
+	Its extensions are looked up first, in a table filled once at
+	startup. Every type has its 200 response header pre-rendered up to
+	the Content-Type line.
+*/
+struct content_type_t {
+	const char *name;
+	header_t header;
+	bool compressible;      // sent gzip/brotli encoded when the client accepts it
+};
+
+#define CONTENT_TYPE(name, compressible) { name, HEADER("HTTP/1.1 200 OK\r\n" SERVER_LINE "Content-Type: " name "\r\n"), compressible }
+
+content_type_t const builtin_content_types[CONTENT_TYPES] = {
+	CONTENT_TYPE("text/html", true),
+	CONTENT_TYPE("text/css", true),
+	CONTENT_TYPE("text/javascript", true),
+	CONTENT_TYPE("application/json", true),
+	CONTENT_TYPE("application/xml", true),
+	CONTENT_TYPE("text/plain", true),
+	CONTENT_TYPE("text/csv", true),
+	CONTENT_TYPE("image/svg+xml", true),
+	CONTENT_TYPE("image/png", false),
+	CONTENT_TYPE("image/jpeg", false),
+	CONTENT_TYPE("image/gif", false),
+	CONTENT_TYPE("image/webp", false),
+	CONTENT_TYPE("image/avif", false),
+	CONTENT_TYPE("image/x-icon", false),
+	CONTENT_TYPE("font/woff", false),
+	CONTENT_TYPE("font/woff2", false),
+	CONTENT_TYPE("font/ttf", true),
+	CONTENT_TYPE("font/otf", true),
+	CONTENT_TYPE("application/pdf", false),
+	CONTENT_TYPE("application/wasm", true),
+	CONTENT_TYPE("video/mp4", false),
+	CONTENT_TYPE("video/webm", false),
+	CONTENT_TYPE("audio/mpeg", false),
+	CONTENT_TYPE("audio/ogg", false),
+	CONTENT_TYPE("audio/wav", false),
+	CONTENT_TYPE("application/manifest+json", true),
+	CONTENT_TYPE("application/zip", false),
+	CONTENT_TYPE("application/octet-stream", false),
+};
+
+vector<content_type_t> content_types(builtin_content_types, builtin_content_types + CONTENT_TYPES);
+std::deque<string> content_type_strings;    // names and headers of the types added by -f
+
+struct extension_t {
+	const char *extension;
+	content_type type;
+};
+
+constexpr extension_t extensions[] = {
+	{"html", HTML}, {"htm", HTML}, {"css", CSS}, {"js", JS}, {"mjs", JS}, {"json", JSON}, {"map", JSON},
+	{"xml", XML}, {"txt", TEXT}, {"csv", CSV}, {"svg", SVG}, {"png", PNG}, {"jpg", JPEG}, {"jpeg", JPEG},
+	{"gif", GIF}, {"webp", WEBP}, {"avif", AVIF}, {"ico", ICO}, {"woff", WOFF}, {"woff2", WOFF2},
+	{"ttf", TTF}, {"otf", OTF}, {"pdf", PDF}, {"wasm", WASM}, {"mp4", MP4}, {"webm", WEBM}, {"mp3", MP3},
+	{"ogg", OGG}, {"wav", WAV}, {"webmanifest", MANIFEST}, {"zip", ZIP},
+	{"", OCTET_STREAM}      // the empty slots point here
+};
+
+constexpr int extensions_count = sizeof(extensions) / sizeof(extensions[0]) - 1;
+
+constexpr uint32_t extension_hash(const char *extension, uint32_t hash = 2166149748u) {
+	return *extension ? extension_hash(extension + 1, (hash ^ (unsigned char)*extension) * 16777619u) : hash;
+}
+
+constexpr unsigned extension_slot(const char *extension) {
+	return extension_hash(extension) >> (32 - EXTENSION_SLOT_BITS);
+}
+
+constexpr unsigned char extension_in_slot(unsigned slot, int i = 0) {
+	return i == extensions_count || extension_slot(extensions[i].extension) == slot ? i : extension_in_slot(slot, i + 1);
+}
+
+constexpr bool extension_slot_unique(int i, int j) {
+	return j == extensions_count || (extension_slot(extensions[i].extension) != extension_slot(extensions[j].extension) && extension_slot_unique(i, j + 1));
+}
+
+constexpr bool extension_slots_distinct(int i = 0) {
+	return i == extensions_count || (extension_slot_unique(i, i + 1) && extension_slots_distinct(i + 1));
+}
+
+static_assert(extension_slots_distinct(), "two built-in extensions share a slot: change the offset basis of extension_hash()");
+
+#define EXTENSION_SLOTS_8(slot) extension_in_slot(slot), extension_in_slot(slot + 1), extension_in_slot(slot + 2), extension_in_slot(slot + 3), \
+	extension_in_slot(slot + 4), extension_in_slot(slot + 5), extension_in_slot(slot + 6), extension_in_slot(slot + 7)
+
+constexpr unsigned char extension_slots[1 << EXTENSION_SLOT_BITS] = {
+	EXTENSION_SLOTS_8(0), EXTENSION_SLOTS_8(8), EXTENSION_SLOTS_8(16), EXTENSION_SLOTS_8(24),
+	EXTENSION_SLOTS_8(32), EXTENSION_SLOTS_8(40), EXTENSION_SLOTS_8(48), EXTENSION_SLOTS_8(56)
+};
+
+static_assert(sizeof(extension_slots) == 64, "extension_slots[] is written out for 64 slots");
+
+struct extension_override_t {
+	char extension[EXTENSION_MAX + 1];  // empty: free slot
+	content_type type;
+};
+
+vector<extension_override_t> extension_overrides;   // open addressing, a power of two in size; empty without -f
+
+bool mime_type_compressible(const string &name) {
+	return name.compare(0, 5, "text/") == 0 || name.find("json") != string::npos || name.find("xml") != string::npos
+		|| name.find("javascript") != string::npos || name == "application/wasm";
+}
+
+content_type content_type_add(const string &name) {
+	for(size_t i = 0; i < content_types.size(); ++i) {
+		if(strcasecmp(content_types[i].name, name.c_str()) == 0) {
+			return (content_type)i;
+		}
+	}
+
+	content_type_strings.push_back(name);
+	content_type_t added;
+	added.name = content_type_strings.back().c_str();
+	content_type_strings.push_back("HTTP/1.1 200 OK\r\n" SERVER_LINE "Content-Type: " + name + "\r\n");
+	added.header.data = content_type_strings.back().data();
+	added.header.size = content_type_strings.back().size();
+	added.compressible = mime_type_compressible(name);
+	content_types.push_back(added);
+	return (content_type)(content_types.size() - 1);
+}
+
+void extension_override_set(const string &extension, content_type type) {
+	size_t mask = extension_overrides.size() - 1;
+	size_t slot = extension_hash(extension.c_str()) & mask;
+	while(extension_overrides[slot].extension[0] && extension != extension_overrides[slot].extension) {
+		slot = (slot + 1) & mask;
+	}
+	strcpy(extension_overrides[slot].extension, extension.c_str());
+	extension_overrides[slot].type = type;
+}
+
+bool mime_types_load(const char *file_name) {
+	ifstream file(file_name);
+	if(!file) {
+		cerr << "Can't open MIME types " << file_name << endl;
+		return false;
+	}
+
+	vector<std::pair<string, content_type> > mappings;
+	string line;
+	int line_number = 0;
+	while(getline(file, line)) {
+		++line_number;
+
+		size_t comment = line.find('#');
+		if(comment != string::npos) {
+			line.erase(comment);
+		}
+		std::istringstream words(line);
+		string name, extension;
+		if(!(words >> name) || name == "types" || name == "{" || name == "}") {
+			// the "types { ... }" block of nginx
+			continue;
+		}
+		if(name.find('/') == string::npos) {
+			cerr << file_name << ":" << line_number << ": MIME type expected" << endl;
+			return false;
+		}
+
+		vector<string> type_extensions;
+		while(words >> extension) {
+			if(extension[extension.size() - 1] == ';') {
+				extension.erase(extension.size() - 1);
+			}
+			if(!extension.empty() && extension[0] == '.') {
+				extension.erase(0, 1);
+			}
+			if(extension.empty()) {
+				continue;
+			}
+			if(extension.size() > EXTENSION_MAX) {
+				cerr << file_name << ":" << line_number << ": extension " << extension << " is too long, skipped" << endl;
+				continue;
+			}
+			transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+			type_extensions.push_back(extension);
+		}
+		if(type_extensions.empty()) {
+			continue;
+		}
+
+		content_type type = content_type_add(name);
+		for(size_t i = 0; i < type_extensions.size(); ++i) {
+			mappings.push_back(std::make_pair(type_extensions[i], type));
+		}
+	}
+
+	size_t slots = 1;
+	while(slots < mappings.size() * 2) {
+		slots *= 2;
+	}
+	extension_override_t free_slot;
+	memset(&free_slot, 0, sizeof(free_slot));
+	extension_overrides.assign(slots, free_slot);
+	for(size_t i = 0; i < mappings.size(); ++i) {
+		extension_override_set(mappings[i].first, mappings[i].second);
+	}
+
+	return true;
+}
+
+content_type get_content_type(const string_view_t &filename) {
+	// the extension is after the last '.' of the last path segment
+	const char *end = filename.data + filename.size;
+	const char *dot = end;
+	while(dot > filename.data && dot[-1] != '.' && dot[-1] != '/') {
+		--dot;
+	}
+	int size = end - dot;
+	if(dot == filename.data || dot[-1] != '.' || size == 0 || size > EXTENSION_MAX) {
+		return OCTET_STREAM;
+	}
+
+	char extension[EXTENSION_MAX + 1];
+	for(int i = 0; i < size; ++i) {
+		extension[i] = (dot[i] >= 'A' && dot[i] <= 'Z') ? dot[i] + ('a' - 'A') : dot[i];
+	}
+	extension[size] = '\0';
+	uint32_t hash = extension_hash(extension);
+
+	if(!extension_overrides.empty()) {
+		size_t mask = extension_overrides.size() - 1;
+		for(size_t slot = hash & mask; extension_overrides[slot].extension[0]; slot = (slot + 1) & mask) {
+			if(strcmp(extension_overrides[slot].extension, extension) == 0) {
+				return extension_overrides[slot].type;
+			}
+		}
+	}
+
+	const extension_t &builtin = extensions[extension_slots[hash >> (32 - EXTENSION_SLOT_BITS)]];
+	return strcmp(builtin.extension, extension) == 0 ? builtin.type : OCTET_STREAM;
+}
+
+header_t const &get_content_type_header(content_type _content_type) {
+	return content_types[_content_type].header;
+}
+
+char const *get_content_type_name(content_type _content_type) {
+	return content_types[_content_type].name;
+}
+
+/*
+	CONTENT ENCODING
+
+	Text files may go out gzip or brotli encoded. The encoded bodies come
+	from sidecar files next to the original (index.html.gz, index.html.br)
+	when those are at least as new as it, otherwise the master compresses
+	cached files once while loading them (see cache_create_blob()). Brotli
+	compression needs the library (HAVE_BROTLI); .br sidecars are served
+	without it.
+*/
+bool content_type_compressible(content_type _content_type) {
+	return content_types[_content_type].compressible;
+}
+
+/*
+	Returns the encodings the client accepts as a bit mask of
+	1 << content_encoding; identity is always acceptable
+*/
+int accepted_encodings(const http_request_t &request) {
+	const string_view_t &value = request.headers[HEADER_ACCEPT_ENCODING];
+	if(!value.data) {
+		return 1 << ENCODING_IDENTITY;
+	}
+	const char *buffer = value.data;
+	int value_end_index = value.size;
+
+	int accepted = 1 << ENCODING_IDENTITY;
+	int refused = 0;
+	bool any = false;
+
+	int i = 0;
+	while(i < value_end_index) {
+		while(i < value_end_index && (buffer[i] == ' ' || buffer[i] == '\t' || buffer[i] == ',')) {
+			++i;
+		}
+		int token_begin = i;
+		while(i < value_end_index && buffer[i] != ',' && buffer[i] != ';' && buffer[i] != ' ' && buffer[i] != '\t') {
+			++i;
+		}
+		int token_size = i - token_begin;
+
+		// ";q=0" refuses the coding
+		bool zero_quality = false;
+		while(i < value_end_index && buffer[i] != ',') {
+			if(buffer[i] == '=' && i + 1 < value_end_index && buffer[i + 1] == '0') {
+				zero_quality = true;
+				for(int j = i + 2; j < value_end_index && buffer[j] != ','; ++j) {
+					if(buffer[j] >= '1' && buffer[j] <= '9') {
+						zero_quality = false;
+					}
+				}
+			}
+			++i;
+		}
+
+		int coding = 0;
+		if((token_size == 4 && strncasecmp(buffer + token_begin, "gzip", 4) == 0)
+			|| (token_size == 6 && strncasecmp(buffer + token_begin, "x-gzip", 6) == 0)) {
+			coding = 1 << ENCODING_GZIP;
+		} else if(token_size == 2 && strncasecmp(buffer + token_begin, "br", 2) == 0) {
+			coding = 1 << ENCODING_BR;
+		} else if(token_size == 1 && buffer[token_begin] == '*') {
+			any = !zero_quality;
+			continue;
+		}
+
+		if(zero_quality) {
+			refused |= coding;
+		} else {
+			accepted |= coding;
+		}
+	}
+
+	if(any) {
+		accepted |= ((1 << ENCODINGS) - 1) & ~refused;
+	}
+
+	return accepted;
+}
+
+bool compress_gzip(const string &input, string &output) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// 16 + MAX_WBITS: gzip wrapper instead of zlib
+	if(deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+
+	output.resize(deflateBound(&stream, input.size()));
+	stream.next_in = (Bytef *)input.data();
+	stream.avail_in = input.size();
+	stream.next_out = (Bytef *)&output[0];
+	stream.avail_out = output.size();
+
+	int result = deflate(&stream, Z_FINISH);
+	output.resize(stream.total_out);
+	deflateEnd(&stream);
+
+	return result == Z_STREAM_END;
+}
+
+bool compress_brotli(const string &input, string &output) {
+#ifdef HAVE_BROTLI
+	size_t size = BrotliEncoderMaxCompressedSize(input.size());
+	if(size == 0) {
+		return false;
+	}
+	output.resize(size);
+	if(!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+			input.size(), (const uint8_t *)input.data(), &size, (uint8_t *)&output[0])) {
+		return false;
+	}
+	output.resize(size);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+	Opens the sidecar of full_path for encoding if it is a regular file not
+	older than the original. Returns the descriptor or -1.
+*/
+int open_sidecar(const string &full_path, int encoding, const struct stat &file_stat, struct stat *sidecar_stat) {
+	int sidecar_fd = open((full_path + encoding_suffixes[encoding]).c_str(), O_RDONLY);
+	if(sidecar_fd == -1) {
+		return -1;
+	}
+
+	if(fstat(sidecar_fd, sidecar_stat) == -1 || !S_ISREG(sidecar_stat->st_mode)
+		|| sidecar_stat->st_mtim.tv_sec < file_stat.st_mtim.tv_sec
+		|| (sidecar_stat->st_mtim.tv_sec == file_stat.st_mtim.tv_sec && sidecar_stat->st_mtim.tv_nsec < file_stat.st_mtim.tv_nsec)) {
+		close(sidecar_fd);
+		return -1;
+	}
+
+	return sidecar_fd;
+}
+
+/*
+	CACHE POLICY
+
+	Cache-Control values per file extension, loaded from
+	global_args.cache_policy_file (-x), one extension per line:
+
+		# extension  Cache-Control
+		.html        no-cache
+		.png         public, max-age=86400
+		*            max-age=60
+
+	"*" applies to all other files. Without a policy no Cache-Control is
+	sent. A max-age also adds an Expires header for HTTP/1.0 caches.
+*/
+struct cache_policy_t {
+	string cache_control;
+	int max_age;            // seconds for Expires, -1: no Expires
+};
+
+std::map<string, cache_policy_t> cache_policies;   // by lowercase extension with the dot
+
+bool cache_policy_load(const char *file_name) {
+	ifstream file(file_name);
+	if(!file) {
+		cerr << "Can't open cache policy " << file_name << endl;
+		return false;
+	}
+
+	string line;
+	int line_number = 0;
+	while(getline(file, line)) {
+		++line_number;
+
+		size_t extension_begin = line.find_first_not_of(" \t\r");
+		if(extension_begin == string::npos || line[extension_begin] == '#') {
+			continue;
+		}
+		size_t extension_end = line.find_first_of(" \t", extension_begin);
+		size_t value_begin = extension_end == string::npos ? string::npos : line.find_first_not_of(" \t\r", extension_end);
+		if(value_begin == string::npos) {
+			cerr << file_name << ":" << line_number << ": Cache-Control value expected" << endl;
+			return false;
+		}
+		size_t value_end = line.find_last_not_of(" \t\r") + 1;
+
+		string extension = line.substr(extension_begin, extension_end - extension_begin);
+		transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if(extension != "*" && extension[0] != '.') {
+			extension = "." + extension;
+		}
+
+		cache_policy_t &policy = cache_policies[extension];
+		policy.cache_control = line.substr(value_begin, value_end - value_begin);
+		policy.max_age = -1;
+
+		size_t max_age = policy.cache_control.find("max-age=");
+		if(max_age != string::npos) {
+			policy.max_age = atoi(policy.cache_control.c_str() + max_age + strlen("max-age="));
+		}
+	}
+
+	return true;
+}
+
+const cache_policy_t *cache_policy_find(const string_view_t &filename) {
+	if(cache_policies.empty()) {
+		return NULL;
+	}
+
+	std::map<string, cache_policy_t>::const_iterator it;
+
+	// the extension is the last '.' of the last path segment and after it
+	const char *end = filename.data + filename.size;
+	const char *extension = end;
+	while(extension > filename.data && extension[-1] != '.' && extension[-1] != '/') {
+		--extension;
+	}
+	if(extension > filename.data && extension[-1] == '.') {
+		string key(extension - 1, end);
+		transform(key.begin(), key.end(), key.begin(), ::tolower);
+		it = cache_policies.find(key);
+		if(it != cache_policies.end()) {
+			return &it->second;
+		}
+	}
+
+	it = cache_policies.find("*");
+	return it != cache_policies.end() ? &it->second : NULL;
+}
+
+/*
+	Appends "Expires: <now + max_age>". The line is formatted again only
+	when the expiry second changes.
+*/
+void append_expires(string &response, int max_age) {
+	if(max_age < 0) {
+		return;
+	}
+
+	static thread_local time_t formatted_expires = -1;
+	static thread_local char line[64];
+	static thread_local size_t line_size = 0;
+
+	time_t expires = time(NULL) + max_age;
+	if(expires != formatted_expires) {
+		struct tm expires_tm;
+		gmtime_r(&expires, &expires_tm);
+		line_size = strftime(line, sizeof(line), "Expires: %a, %d %b %Y %H:%M:%S GMT\r\n", &expires_tm);
+		formatted_expires = expires;
+	}
+
+	response.append(line, line_size);
+}
+
+/*
+	Renders the entity tag of a file from its modification time and size
+	into etag, "" with -e off. Every encoding of the file is a different
+	representation and gets its own tag. A weak tag (W/"...") only promises
+	an equivalent body, not a byte-identical one.
+*/
+void render_etag(char *etag, size_t size, const struct stat &file_stat, int encoding) {
+	if(global_args.etag == ETAG_OFF) {
+		etag[0] = '\0';
+		return;
+	}
+
+	snprintf(etag, size, "%s\"%lx.%lx-%lx%s%s\"", global_args.etag == ETAG_WEAK ? "W/" : "",
+		(unsigned long)file_stat.st_mtim.tv_sec, (unsigned long)file_stat.st_mtim.tv_nsec, (unsigned long)file_stat.st_size,
+		encoding == ENCODING_IDENTITY ? "" : "-", encoding == ENCODING_IDENTITY ? "" : encoding_names[encoding]);
+}
+
+void append_last_modified(string &response, time_t modified) {
+	char line[64];
+	struct tm modified_tm;
+	gmtime_r(&modified, &modified_tm);
+	response.append(line, strftime(line, sizeof(line), "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", &modified_tm));
+}
+
+void append_cache_headers(string &response, content_type _content_type, const char *etag, const cache_policy_t *policy) {
+	if(content_type_compressible(_content_type)) {
+		response += "Vary: Accept-Encoding\r\n";
+	}
+	if(*etag) {
+		response += "ETag: ";
+		response += etag;
+		response += "\r\n";
+	}
+	if(policy) {
+		response += "Cache-Control: ";
+		response += policy->cache_control;
+		response += "\r\n";
+	}
+}
+
+/*
+	Renders the header of a static file response up to the Connection line:
+	status, Content-Type, Content-Encoding, Content-Length, the validators
+	and Cache-Control. Expires depends on the time of the request and is
+	appended by the caller.
+*/
+void render_file_header(string &response, content_type _content_type, const struct stat &file_stat, int encoding, size_t body_size, const char *etag, const cache_policy_t *policy) {
+	header_t const &header = get_content_type_header(_content_type);
+	response.append(header.data, header.size);
+
+	if(encoding != ENCODING_IDENTITY) {
+		response += "Content-Encoding: ";
+		response += encoding_names[encoding];
+		response += "\r\n";
+	}
+
+	append_content_length(response, body_size);
+	response += "Accept-Ranges: bytes\r\n";
+	append_last_modified(response, file_stat.st_mtime);
+	append_cache_headers(response, _content_type, etag, policy);
+}
+
+/*
+	Renders the 304 response header up to the Connection line. It repeats
+	Vary, ETag and Cache-Control of the 200 response, and Last-Modified only
+	when there is no ETag. A 304 never has a body.
+*/
+void render_not_modified_header(string &response, content_type _content_type, const struct stat &file_stat, const char *etag, const cache_policy_t *policy) {
+	response.append(header_304.data, header_304.size);
+
+	if(!*etag) {
+		append_last_modified(response, file_stat.st_mtime);
+	}
+	append_cache_headers(response, _content_type, etag, policy);
+}
+
+/*
+	Weak comparison of an If-None-Match list ("a", W/"b", or *) with etag
+*/
+bool etag_list_matches(const char *list, const char *list_end, const char *etag) {
+	if(etag[0] == 'W' && etag[1] == '/') {
+		etag += 2;
+	}
+	size_t etag_size = strlen(etag);
+
+	const char *tag = list;
+	while(tag < list_end) {
+		while(tag < list_end && (*tag == ' ' || *tag == '\t' || *tag == ',')) {
+			++tag;
+		}
+		if(tag == list_end) {
+			break;
+		}
+		if(*tag == '*') {
+			return true;
+		}
+		if(list_end - tag > 2 && tag[0] == 'W' && tag[1] == '/') {
+			tag += 2;
+		}
+
+		const char *tag_end = tag + 1;
+		if(*tag == '"') {
+			while(tag_end < list_end && *tag_end != '"') {
+				++tag_end;
+			}
+			if(tag_end == list_end) {
+				return false;
+			}
+			++tag_end;
+		} else {
+			while(tag_end < list_end && *tag_end != ',') {
+				++tag_end;
+			}
+		}
+
+		if((size_t)(tag_end - tag) == etag_size && memcmp(tag, etag, etag_size) == 0) {
+			return true;
+		}
+		tag = tag_end;
+	}
+
+	return false;
+}
+
+/*
+	Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT")
+*/
+bool parse_http_date(const char *value, const char *value_end, time_t *date) {
+	string text(value, value_end - value);
+	struct tm date_tm;
+	memset(&date_tm, 0, sizeof(date_tm));
+	const char *parsed = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &date_tm);
+	if(!parsed || *parsed != '\0') {
+		return false;
+	}
+	*date = timegm(&date_tm);
+	return true;
+}
+
+/*
+	Conditional GET (RFC 7232): true when the client's copy is current.
+	If-Modified-Since is only looked at without If-None-Match.
+*/
+bool request_not_modified(const http_request_t &request, const char *etag, time_t modified) {
+	const string_view_t &if_none_match = request.headers[HEADER_IF_NONE_MATCH];
+	if(if_none_match.data) {
+		return *etag && etag_list_matches(if_none_match.data, if_none_match.data + if_none_match.size, etag);
+	}
+
+	const string_view_t &if_modified_since = request.headers[HEADER_IF_MODIFIED_SINCE];
+	time_t since;
+	if(if_modified_since.data) {
+		return parse_http_date(if_modified_since.data, if_modified_since.data + if_modified_since.size, &since) && modified <= since;
+	}
+
+	return false;
+}
+
+/*
+	RANGE REQUESTS (RFC 7233)
+
+	A Range of byte ranges is answered with 206: one range with a
+	Content-Range header, several as a multipart/byteranges body. Ranges
+	entirely past the end are dropped; if none is left the answer is 416.
+	Malformed headers, more than RANGES_MAX ranges or a stale If-Range get
+	the whole body.
+*/
+enum range_result {RANGE_NONE, RANGE_PARTIAL, RANGE_UNSATISFIABLE};
+
+struct byte_range_t {
+	off_t begin;
+	off_t end;              // exclusive
+};
+
+/*
+	If-Range holds either an entity tag, compared strongly, or a date that
+	must be the exact modification time
+*/
+bool if_range_matches(const char *value, const char *value_end, const char *etag, time_t modified) {
+	if(value < value_end && (*value == '"' || *value == 'W')) {
+		size_t etag_size = strlen(etag);
+		return etag_size > 0 && etag[0] == '"'
+			&& (size_t)(value_end - value) == etag_size && memcmp(value, etag, etag_size) == 0;
+	}
+
+	time_t date;
+	return parse_http_date(value, value_end, &date) && date == modified;
+}
+
+/*
+	Reads decimal digits at *p. Returns false on no digits or overflow.
+*/
+bool parse_range_number(const char **p, const char *end, off_t *number) {
+	const char *begin = *p;
+	off_t value = 0;
+	while(*p < end && **p >= '0' && **p <= '9') {
+		if(value > (LLONG_MAX - 9) / 10) {
+			return false;
+		}
+		value = value * 10 + (**p - '0');
+		++*p;
+	}
+	*number = value;
+	return *p > begin;
+}
+
+range_result parse_ranges(const http_request_t &request, off_t size, const char *etag, time_t modified, vector<byte_range_t> &ranges) {
+	const string_view_t &range = request.headers[HEADER_RANGE];
+	if(!range.data) {
+		return RANGE_NONE;
+	}
+
+	const string_view_t &if_range = request.headers[HEADER_IF_RANGE];
+	if(if_range.data && !if_range_matches(if_range.data, if_range.data + if_range.size, etag, modified)) {
+		return RANGE_NONE;
+	}
+
+	const char *p = range.data;
+	const char *end = range.data + range.size;
+	if(end - p < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+		return RANGE_NONE;
+	}
+	p += 6;
+
+	ranges.clear();
+	int specs = 0;
+
+	while(p < end) {
+		while(p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+			++p;
+		}
+		if(p == end) {
+			break;
+		}
+
+		byte_range_t range;
+		off_t first, last;
+
+		if(*p == '-') {
+			// suffix: the last bytes
+			++p;
+			if(!parse_range_number(&p, end, &last)) {
+				return RANGE_NONE;
+			}
+			range.begin = last < size ? size - last : 0;
+			range.end = last > 0 ? size : 0;
+		} else {
+			if(!parse_range_number(&p, end, &first) || p == end || *p != '-') {
+				return RANGE_NONE;
+			}
+			++p;
+			range.begin = first;
+			range.end = size;
+			if(p < end && *p >= '0' && *p <= '9') {
+				if(!parse_range_number(&p, end, &last) || last < first) {
+					return RANGE_NONE;
+				}
+				range.end = min(last + 1, size);
+			}
+		}
+
+		while(p < end && (*p == ' ' || *p == '\t')) {
+			++p;
+		}
+		if(p < end && *p != ',') {
+			return RANGE_NONE;
+		}
+
+		if(++specs > RANGES_MAX) {
+			return RANGE_NONE;
+		}
+		if(range.begin < range.end) {
+			ranges.push_back(range);
+		}
+	}
+
+	if(specs == 0) {
+		return RANGE_NONE;
+	}
+
+	return ranges.empty() ? RANGE_UNSATISFIABLE : RANGE_PARTIAL;
+}
+
+/*
+	STATIC FILE CACHE
+
+	Before forking, the master loads the files under global_args.directory
+	into memfd blobs holding the rendered headers and the body, plus the
+	gzip and brotli encoded bodies of text files. The blobs are
+	mapped MAP_SHARED, so all workers read the same physical pages and a hit
+	costs one map lookup and no filesystem syscalls. Files are admitted
+	smallest first until global_args.cache_size (encoded variants included)
+	is used up, so text is compressed once per change; files bigger than
+	CACHE_MAX_FILE_SIZE are always sent from disk with sendfile().
+
+	A file that changes later and no longer fits makes room by CLOCK
+	eviction (see cache_make_room()): a worker sets the referenced flag of
+	a blob when it serves it, and the master evicts blobs not served since
+	its last pass. Evicted files are sent from disk until they change.
+*/
+struct cache_blob_variant_t {
+	char etag[ETAG_SIZE];       // validator for request_not_modified()
+	size_t header_size;         // 0: the file has no such encoding
+	size_t not_modified_size;   // the 304 header follows the 200 one
+	size_t body_size;
+};
+
+/*
+	A blob is this struct followed by the header, the 304 header and the
+	body of every encoding present, in content_encoding order
+*/
+struct cache_blob_t {
+	char path[PATH_MAX];    // request path, e.g. "/index.html"
+	int removed;            // tombstone: drop the entry for path
+	int referenced;         // set by workers on a hit, cleared by the master; the only field written after creation
+	time_t modified;
+	int max_age;            // for Expires, -1: none
+	cache_blob_variant_t variants[ENCODINGS];
+};
+
+struct cache_variant_t {
+	const char *etag;
+	const char *header;
+	size_t header_size;
+	const char *not_modified;
+	size_t not_modified_size;
+	const char *body;
+	size_t body_size;
+};
+
+struct cache_entry_t {
+	char *map;
+	size_t map_size;
+	int *referenced;        // cache_blob_t::referenced in map
+	time_t modified;
+	int max_age;
+	int encodings;          // 1 << content_encoding of the variants present
+	cache_variant_t variants[ENCODINGS];
+
+	~cache_entry_t() {
+		munmap(map, map_size);
+	}
+};
+
+typedef std::shared_ptr<cache_entry_t> cache_entry_ptr;
+
+typedef std::map<string, cache_entry_ptr> file_cache_t;
+
+file_cache_t file_cache;
+size_t file_cache_used = 0;
+std::mutex file_cache_mutex;     // request threads look up while the event loop applies updates
+
+// file_cache by hash of the path, so that a request path is looked up
+// where it lies in the request buffer instead of being copied into a key
+typedef std::unordered_multimap<uint32_t, file_cache_t::iterator> file_cache_index_t;
+file_cache_index_t file_cache_index;
+
+uint32_t cache_path_hash(const char *data, int size) {
+	uint32_t hash = 2166136261u;    // FNV-1a
+	for(int i = 0; i < size; ++i) {
+		hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+	}
+	return hash;
+}
+
+cache_entry_ptr cache_lookup(const string_view_t &path) {
+	// With one request thread the event loop applies the updates itself
+	std::unique_lock<std::mutex> lock(file_cache_mutex, std::defer_lock);
+	if(global_args.threads > 1) {
+		lock.lock();
+	}
+
+	std::pair<file_cache_index_t::iterator, file_cache_index_t::iterator> range =
+		file_cache_index.equal_range(cache_path_hash(path.data, path.size));
+	for(file_cache_index_t::iterator it = range.first; it != range.second; ++it) {
+		const string &key = it->second->first;
+		if(key.size() == path.size && memcmp(key.data(), path.data, path.size) == 0) {
+			return it->second->second;
+		}
+	}
+	return cache_entry_ptr();
+}
+
+/*
+	Replaces the entry for path with entry, or drops it when entry is
+	empty, keeping file_cache_index and file_cache_used in step
+*/
+void cache_store(const string &path, const cache_entry_ptr &entry) {
+	uint32_t hash = cache_path_hash(path.data(), path.size());
+
+	file_cache_t::iterator it = file_cache.find(path);
+	if(it != file_cache.end()) {
+		std::pair<file_cache_index_t::iterator, file_cache_index_t::iterator> range = file_cache_index.equal_range(hash);
+		for(file_cache_index_t::iterator indexed = range.first; indexed != range.second; ++indexed) {
+			if(indexed->second == it) {
+				file_cache_index.erase(indexed);
+				break;
+			}
+		}
+		file_cache_used -= it->second->map_size;
+		file_cache.erase(it);
+	}
+
+	if(entry) {
+		it = file_cache.insert(std::make_pair(path, entry)).first;
+		file_cache_index.insert(std::make_pair(hash, it));
+		file_cache_used += entry->map_size;
+	}
+}
+
+/*
+	Marks an entry as used for CLOCK eviction. The flag is only written
+	when it is clear, so a hot blob does not bounce its cache line
+	between workers.
+*/
+void cache_touch(const cache_entry_t &entry) {
+	if(!__atomic_load_n(entry.referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(entry.referenced, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+	Picks the encoding to send out of a mask of 1 << content_encoding:
+	brotli, then gzip, then identity
+*/
+int preferred_encoding(int encodings) {
+	for(int encoding = ENCODINGS - 1; encoding > ENCODING_IDENTITY; --encoding) {
+		if(encodings & (1 << encoding)) {
+			return encoding;
+		}
+	}
+	return ENCODING_IDENTITY;
+}
+
+/*
+	Maps a blob created by cache_create_blob()
+*/
+cache_entry_ptr cache_map_blob(int memfd, string *path) {
+	struct stat blob_stat;
+	if(fstat(memfd, &blob_stat) == -1 || blob_stat.st_size < (off_t)sizeof(cache_blob_t)) {
+		return cache_entry_ptr();
+	}
+
+	// Writable for the referenced flag only
+	char *map = (char *)mmap(NULL, blob_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if(map == MAP_FAILED) {
+		log_error << "Cache mmap error: " << strerror(errno) << endl;
+		return cache_entry_ptr();
+	}
+
+	cache_blob_t *blob = (cache_blob_t *)map;
+
+	cache_entry_ptr entry(new cache_entry_t());
+	entry->map = map;
+	entry->map_size = blob_stat.st_size;
+	entry->referenced = &blob->referenced;
+	entry->modified = blob->modified;
+	entry->max_age = blob->max_age;
+	entry->encodings = 0;
+
+	const char *data = map + sizeof(cache_blob_t);
+	for(int encoding = 0; encoding < ENCODINGS; ++encoding) {
+		const cache_blob_variant_t &blob_variant = blob->variants[encoding];
+		cache_variant_t &variant = entry->variants[encoding];
+		if(blob_variant.header_size == 0) {
+			memset(&variant, 0, sizeof(variant));
+			continue;
+		}
+		entry->encodings |= 1 << encoding;
+		variant.etag = blob_variant.etag;
+		variant.header = data;
+		variant.header_size = blob_variant.header_size;
+		variant.not_modified = variant.header + blob_variant.header_size;
+		variant.not_modified_size = blob_variant.not_modified_size;
+		variant.body = variant.not_modified + blob_variant.not_modified_size;
+		variant.body_size = blob_variant.body_size;
+		data = variant.body + variant.body_size;
+	}
+
+	*path = blob->path;
+
+	if(blob->removed) {
+		return cache_entry_ptr();
+	}
+
+	return entry;
+}
+
+bool read_file(int fd, size_t size, string &data) {
+	data.resize(size);
+	size_t done = 0;
+	while(done < size) {
+		ssize_t result = read(fd, &data[done], size - done);
+		if(result <= 0) {
+			return false;
+		}
+		done += result;
+	}
+	return true;
+}
+
+/*
+	Reads a file and its encoded variants into a new memfd blob. Returns
+	the memfd or -1.
+*/
+int cache_create_blob(const string &path, const string &full_path) {
+	if(path.size() >= PATH_MAX) {
+		return -1;
+	}
+
+	int file_fd = open(full_path.c_str(), O_RDONLY);
+	if(file_fd == -1) {
+		return -1;
+	}
+
+	struct stat file_stat;
+	if(fstat(file_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+		close(file_fd);
+		return -1;
+	}
+
+	string bodies[ENCODINGS];
+	bool present[ENCODINGS] = {true, false, false};
+
+	bool ok = read_file(file_fd, file_stat.st_size, bodies[ENCODING_IDENTITY]);
+	close(file_fd);
+
+	if(!ok) {
+		log_error << "Cache: can't load " << full_path << endl;
+		return -1;
+	}
+
+	string_view_t path_view = {path.data(), (int)path.size()};
+	content_type _content_type = get_content_type(path_view);
+
+	if(content_type_compressible(_content_type)) {
+		for(int encoding = ENCODING_GZIP; encoding < ENCODINGS; ++encoding) {
+			struct stat sidecar_stat;
+			int sidecar_fd = open_sidecar(full_path, encoding, file_stat, &sidecar_stat);
+			if(sidecar_fd != -1) {
+				present[encoding] = read_file(sidecar_fd, sidecar_stat.st_size, bodies[encoding]);
+				close(sidecar_fd);
+			}
+			if(!present[encoding]) {
+				present[encoding] = encoding == ENCODING_GZIP
+					? compress_gzip(bodies[ENCODING_IDENTITY], bodies[encoding])
+					: compress_brotli(bodies[ENCODING_IDENTITY], bodies[encoding]);
+				// not worth a variant, e.g. for tiny files
+				present[encoding] = present[encoding] && bodies[encoding].size() < bodies[ENCODING_IDENTITY].size();
+			}
+		}
+	}
+
+	cache_blob_t blob;
+	memset(&blob, 0, sizeof(blob));
+	strcpy(blob.path, path.c_str());
+	blob.modified = file_stat.st_mtime;
+
+	const cache_policy_t *policy = cache_policy_find(path_view);
+	blob.max_age = policy ? policy->max_age : -1;
+
+	string data;
+	for(int encoding = 0; encoding < ENCODINGS; ++encoding) {
+		if(!present[encoding]) {
+			continue;
+		}
+		cache_blob_variant_t &variant = blob.variants[encoding];
+		render_etag(variant.etag, sizeof(variant.etag), file_stat, encoding);
+
+		size_t begin = data.size();
+		render_file_header(data, _content_type, file_stat, encoding, bodies[encoding].size(), variant.etag, policy);
+		variant.header_size = data.size() - begin;
+		render_not_modified_header(data, _content_type, file_stat, variant.etag, policy);
+		variant.not_modified_size = data.size() - begin - variant.header_size;
+		data += bodies[encoding];
+		variant.body_size = bodies[encoding].size();
+
+		log_debug << "Cache: " << path << " " << encoding_names[encoding] << " " << variant.body_size << " bytes" << endl;
+	}
+
+	int memfd = memfd_create("webserver-cache", MFD_CLOEXEC);
+	if(memfd == -1) {
+		log_error << "memfd_create error: " << strerror(errno) << endl;
+		return -1;
+	}
+
+	ok = write(memfd, &blob, sizeof(blob)) == sizeof(blob)
+		&& write(memfd, data.data(), data.size()) == (ssize_t)data.size();
+
+	if(!ok) {
+		log_error << "Cache: can't load " << full_path << endl;
+		close(memfd);
+		return -1;
+	}
+
+	return memfd;
+}
+
+void cache_collect_files(const string &directory, const string &path, vector<pair<off_t, string> > &files) {
+	DIR *dir = opendir((directory + path).c_str());
+	if(!dir) {
+		return;
+	}
+
+	struct dirent *item;
+	while((item = readdir(dir)) != NULL) {
+		if(strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+			continue;
+		}
+
+		string item_path = path + "/" + item->d_name;
+
+		struct stat item_stat;
+		if(stat((directory + item_path).c_str(), &item_stat) == -1) {
+			continue;
+		}
+
+		if(S_ISDIR(item_stat.st_mode)) {
+			cache_collect_files(directory, item_path, files);
+		} else if(S_ISREG(item_stat.st_mode) && item_stat.st_size <= CACHE_MAX_FILE_SIZE) {
+			files.push_back(make_pair(item_stat.st_size, item_path));
+		}
+	}
+
+	closedir(dir);
+}
+
+string cache_directory() {
+	string directory(global_args.directory);
+	while(directory.size() > 1 && directory[directory.size() - 1] == '/') {
+		directory.erase(directory.size() - 1);
+	}
+	return directory;
+}
+
+void cache_fill() {
+	if(global_args.cache_size == 0) {
+		log_info << "Cache: disabled" << endl;
+		return;
+	}
+
+	string directory = cache_directory();
+
+	vector<pair<off_t, string> > files;
+	cache_collect_files(directory, "", files);
+	sort(files.begin(), files.end());
+
+	for(int i = 0; i < files.size(); ++i) {
+		int memfd = cache_create_blob(files[i].second, directory + files[i].second);
+		if(memfd == -1) {
+			continue;
+		}
+
+		string path;
+		cache_entry_ptr entry = cache_map_blob(memfd, &path);
+		close(memfd);
+
+		if(!entry) {
+			continue;
+		}
+
+		if(file_cache_used + entry->map_size > global_args.cache_size) {
+			break;
+		}
+
+		cache_store(path, entry);
+	}
+
+	log_info << "Cache: " << file_cache.size() << " files, " << file_cache_used << " bytes" << endl;
+}
+
+/*
+	The master-worker socketpairs are SOCK_SEQPACKET: one sendmsg() is one
+	recvmsg() on the other side. A message is an array of entries, each
+	with one descriptor in the same position of the SCM_RIGHTS array, so
+	the master passes every connection it hands to a worker within one
+	epoll batch with a single sendmsg().
+
+	A handed-off connection belongs to the worker alone: the master drops
+	it from its epoll set and closes its descriptor once the message is
+	sent. When the worker has answered everything the client sent and the
+	connection stays open, it passes the descriptor back with
+	HANDOFF_RETURN and the master registers it again.
+*/
+#define HANDOFF_BATCH_MAX MAX_EVENTS
+
+struct channel_message_t {
+	char type;          // HANDOFF_KEEP_ALIVE, HANDOFF_CLOSE, HANDOFF_RETURN or CACHE_UPDATE
+	int requests;       // handoff, return: requests served on the connection so far
+	uint32_t peer;      // handoff, return: client IPv4 address, network order
+	uint64_t woke_us;   // handoff: when the master saw the connection readable
+	uint64_t sent_us;   // handoff: when the master passed it on
+};
+
+/*
+	Connections collected for one sendmsg(): in the master those ready within
+	one epoll batch for a worker, in a worker those it returns
+*/
+struct handoff_batch_t {
+	channel_message_t messages[HANDOFF_BATCH_MAX];
+	int fds[HANDOFF_BATCH_MAX];
+	int count;
+
+	handoff_batch_t() : count(0) {}
+};
+
+ssize_t sock_fds_write(int socket, channel_message_t *messages, const int *fds, int count) {
+	log_debug << "sock_fds_write: socket = " << socket << ", " << count << " fds" << endl;
+	ssize_t size;
+	struct msghdr msg;
+	struct iovec iov;
+
+	union {
+		struct cmsghdr cmsghdr;
+		char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH_MAX)];
+	} cmsgu;
+
+	struct cmsghdr * cmsg;
+
+	iov.iov_base = messages;
+	iov.iov_len = sizeof(channel_message_t) * count;
+
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_flags = 0;
+
+	msg.msg_control = cmsgu.control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+	size = sendmsg(socket, &msg, MSG_NOSIGNAL);
+	if(size == -1 && errno == EAGAIN) {
+		log_debug << "sendmsg: socket " << socket << " is full" << endl;
+	} else if(size == -1) {
+		log_error << "Sendmsg error: " << errno << endl;
+		log_error << strerror(errno) << endl;
+	} else {
+		log_debug << "sendmsg: OK. Socket " << socket << ", " << count << " fds with size " << size << endl;
+	}
+	return size;
+}
+
+ssize_t sock_fd_write(int socket, channel_message_t &message, int fd) {
+	return sock_fds_write(socket, &message, &fd, 1);
+}
+
+/*
+	ACCESS LOG
+
+	One fixed-width line per request, appended to ACCESS_LOG_FILE through the
+	log rings (see LOGGING):
+
+	<unix time.usec> <client> <method> <status> <bytes> <accept> <dispatch> <parse> <send> <path>
+
+	The four timings are consecutive phases in microseconds:
+	accept   - from the wakeup that found the connection to the moment it was
+	           accepted or handed over (fdpass: spent in the master)
+	dispatch - from the master passing the connection to a worker receiving
+	           it (0 in reuseport mode)
+	parse    - until the request was complete, including waiting for its bytes
+	send     - until the last byte of the response was written
+	Later requests on a kept-alive connection start when the worker sees
+	their first byte.
+*/
+#define ACCESS_LOG_PATH_SIZE 256
+#define ACCESS_LOG_LINE_SIZE (128 + ACCESS_LOG_PATH_SIZE)
+
+enum request_route {ROUTE_STATIC, ROUTE_CALC, ROUTE_STATS, ROUTES};
+
+struct access_record_t {
+	uint32_t peer;
+	uint64_t woke_us;
+	uint64_t handed_us;
+	uint64_t received_us;   // 0 until the worker sees the request
+	uint64_t parsed_us;
+	method request_method;
+	request_route route;
+	int status;
+	int path_size;
+	char path[ACCESS_LOG_PATH_SIZE];
+};
+
+uint64_t now_us() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void access_record_start(access_record_t &record, uint32_t peer, uint64_t woke_us, uint64_t handed_us) {
+	record.peer = peer;
+	record.woke_us = woke_us;
+	record.handed_us = handed_us;
+	record.received_us = 0;
+	record.parsed_us = 0;
+	record.request_method = UNKNOWN;
+	record.route = ROUTE_STATIC;
+	record.status = 0;
+	record.path[0] = '-';
+	record.path_size = 1;
+}
+
+void access_record_path(access_record_t &record, const string_view_t &path) {
+	record.path_size = min(path.size, ACCESS_LOG_PATH_SIZE);
+	memcpy(record.path, path.data, record.path_size);
+}
+
+/*
+	Writes value right-aligned into field[0..width), padded with fill.
+	Keeps the low digits of a value that does not fit.
+*/
+char *format_fixed(char *field, int width, uint64_t value, char fill) {
+	for(int i = width - 1; i >= 0; --i) {
+		field[i] = (value != 0 || i == width - 1) ? '0' + value % 10 : fill;
+		value /= 10;
+	}
+	field[width] = ' ';
+	return field + width + 1;
+}
+
+uint64_t elapsed_us(uint64_t from, uint64_t to) {
+	return to > from ? to - from : 0;
+}
+
+void access_log_write(const access_record_t &record, size_t bytes, uint64_t sent_us) {
+	struct timespec wall;
+	clock_gettime(CLOCK_REALTIME, &wall);
+
+	char line[ACCESS_LOG_LINE_SIZE];
+	char *end = format_fixed(line, 10, wall.tv_sec, ' ');
+	end[-1] = '.';
+	end = format_fixed(end, 6, wall.tv_nsec / 1000, '0');
+
+	struct in_addr peer;
+	peer.s_addr = record.peer;
+	memset(end, ' ', INET_ADDRSTRLEN);
+	inet_ntop(AF_INET, &peer, end, INET_ADDRSTRLEN);
+	end[strlen(end)] = ' ';
+	end += INET_ADDRSTRLEN;
+
+	const char *method_name = method_names[record.request_method];
+	memset(end, ' ', 5);
+	memcpy(end, method_name, strlen(method_name));
+	end += 5;
+
+	end = format_fixed(end, 3, record.status, ' ');
+	end = format_fixed(end, 12, bytes, ' ');
+	end = format_fixed(end, 9, elapsed_us(record.woke_us, record.handed_us), ' ');
+	end = format_fixed(end, 9, elapsed_us(record.handed_us, record.received_us), ' ');
+	end = format_fixed(end, 9, elapsed_us(record.received_us, record.parsed_us), ' ');
+	end = format_fixed(end, 9, elapsed_us(record.parsed_us, sent_us), ' ');
+
+	memcpy(end, record.path, record.path_size);
+	end += record.path_size;
+	*end++ = '\n';
+
+	log_commit(LOG_SINK_ACCESS, line, end - line);
+}
+
+/*
+	METRICS
+
+	Counters of every worker live in a slot of a shared anonymous mapping
+	created by the master before it forks, so any worker can serve the
+	totals on route_stats (JSON) and route_metrics (Prometheus text format).
+	A worker only writes its own slot with relaxed atomic adds; the master
+	writes handed_off of the worker it passes a connection to. Before it
+	forks a replacement for a dead worker, the master adds the totals of its
+	slot to a retired slot after the worker slots and zeroes the slot, so
+	totals never go back and the new worker starts with no connections in
+	flight.
+
+	Latencies (from the wakeup that found the request to its last byte, in
+	microseconds) go to log-linear histograms per route: 2^LATENCY_SUB_BITS
+	buckets per power of two, as in HDR histograms, so any quantile is
+	known within 25%.
+*/
+#define METRICS_STATUSES 8
+#define LATENCY_SUB_BITS 2
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_EXPONENT 32
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS * LATENCY_MAX_EXPONENT)
+
+// The last entry counts every other status
+int const metrics_statuses[METRICS_STATUSES] = {200, 206, 304, 400, 404, 416, 500, 0};
+
+char const * const route_names[ROUTES] = {"static", "calc", "stats"};
+
+struct latency_histogram_t {
+	std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+	std::atomic<uint64_t> sum_us;
+};
+
+struct worker_metrics_t {
+	std::atomic<pid_t> pid;                     // 0: the slot is free
+	std::atomic<uint64_t> requests[UNKNOWN + 1][METRICS_STATUSES];
+	std::atomic<uint64_t> bytes_sent;
+	std::atomic<uint64_t> cache_hits;
+	std::atomic<uint64_t> cache_misses;
+	std::atomic<uint64_t> parse_errors;
+	std::atomic<int64_t> active_connections;
+	std::atomic<uint64_t> handed_off;           // connections the master passed to the worker
+	std::atomic<uint64_t> picked_up;            // of them, received by the worker
+	std::atomic<uint64_t> completed;            // of them, served and closed or handed back
+	latency_histogram_t latency[ROUTES];
+};
+
+worker_metrics_t *metrics_slots = NULL;
+int metrics_slot_count = 0;
+worker_metrics_t *metrics_retired = NULL;  // metrics_slots[metrics_slot_count]
+
+// The slot of this process. The master and a server without the shared
+// mapping count into a private one.
+worker_metrics_t metrics_private;
+worker_metrics_t *metrics = &metrics_private;
+
+#define METRICS_ADD(counter, value) metrics->counter.fetch_add(value, std::memory_order_relaxed)
+
+void metrics_init(int slot_count) {
+	void *mapping = mmap(NULL, (slot_count + 1) * sizeof(worker_metrics_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(mapping == MAP_FAILED) {
+		log_error << "Metrics mmap error: " << strerror(errno) << endl;
+		return;
+	}
+	metrics_slots = (worker_metrics_t *)mapping;
+	metrics_slot_count = slot_count;
+	for(int i = 0; i <= slot_count; ++i) {
+		new (&metrics_slots[i]) worker_metrics_t();
+	}
+	metrics_retired = &metrics_slots[slot_count];
+}
+
+/*
+	Returns a free slot for a new worker, -1 if there is none
+*/
+int metrics_free_slot() {
+	for(int i = 0; i < metrics_slot_count; ++i) {
+		if(metrics_slots[i].pid.load() == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void metrics_move(std::atomic<uint64_t> &to, std::atomic<uint64_t> &from) {
+	to.fetch_add(from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+/*
+	Called by the master before it forks a worker into the slot: moves the
+	totals of the previous worker to the retired slot and zeroes the rest
+*/
+void metrics_reset(int slot) {
+	if(slot == -1) {
+		return;
+	}
+	worker_metrics_t &from = metrics_slots[slot];
+	for(int m = 0; m <= UNKNOWN; ++m) {
+		for(int s = 0; s < METRICS_STATUSES; ++s) {
+			metrics_move(metrics_retired->requests[m][s], from.requests[m][s]);
+		}
+	}
+	metrics_move(metrics_retired->bytes_sent, from.bytes_sent);
+	metrics_move(metrics_retired->cache_hits, from.cache_hits);
+	metrics_move(metrics_retired->cache_misses, from.cache_misses);
+	metrics_move(metrics_retired->parse_errors, from.parse_errors);
+	for(int r = 0; r < ROUTES; ++r) {
+		for(int b = 0; b < LATENCY_BUCKETS; ++b) {
+			metrics_move(metrics_retired->latency[r].buckets[b], from.latency[r].buckets[b]);
+		}
+		metrics_move(metrics_retired->latency[r].sum_us, from.latency[r].sum_us);
+	}
+	new (&from) worker_metrics_t();
+}
+
+/*
+	Called by a new worker with the slot the master chose and reset for it
+*/
+void metrics_attach(int slot) {
+	if(slot == -1) {
+		return;
+	}
+	metrics = &metrics_slots[slot];
+	metrics->pid = getpid();
+}
+
+// Connections passed to the worker it has not received yet
+int64_t metrics_queued(const worker_metrics_t &slot) {
+	return slot.handed_off.load(std::memory_order_relaxed) - slot.picked_up.load(std::memory_order_relaxed);
+}
+
+// Connections passed to the worker it has not finished yet, queued included
+int64_t metrics_outstanding(const worker_metrics_t &slot) {
+	return slot.handed_off.load(std::memory_order_relaxed) - slot.completed.load(std::memory_order_relaxed);
+}
+
+int metrics_status_index(int status) {
+	for(int i = 0; i < METRICS_STATUSES - 1; ++i) {
+		if(metrics_statuses[i] == status) {
+			return i;
+		}
+	}
+	return METRICS_STATUSES - 1;
+}
+
+int latency_bucket(uint64_t value_us) {
+	if(value_us < LATENCY_SUB_BUCKETS) {
+		return value_us;
+	}
+	int exponent = 63 - __builtin_clzll(value_us);
+	if(exponent > LATENCY_MAX_EXPONENT) {
+		return LATENCY_BUCKETS - 1;
+	}
+	int sub_bucket = (value_us >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+	return LATENCY_SUB_BUCKETS * (exponent - LATENCY_SUB_BITS + 1) + sub_bucket;
+}
+
+// The largest value that falls into the bucket
+uint64_t latency_bucket_limit(int bucket) {
+	if(bucket < LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+	int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	uint64_t sub_bucket = bucket % LATENCY_SUB_BUCKETS;
+	return ((LATENCY_SUB_BUCKETS + sub_bucket + 1) << (exponent - LATENCY_SUB_BITS)) - 1;
+}
+
+void metrics_count_request(const access_record_t &record, size_t bytes, uint64_t latency_us) {
+	METRICS_ADD(requests[record.request_method][metrics_status_index(record.status)], 1);
+	METRICS_ADD(bytes_sent, bytes);
+	METRICS_ADD(latency[record.route].buckets[latency_bucket(latency_us)], 1);
+	METRICS_ADD(latency[record.route].sum_us, latency_us);
+}
+
+/*
+	Totals over all slots, read without stopping the writers
+*/
+struct metrics_totals_t {
+	uint64_t requests[UNKNOWN + 1][METRICS_STATUSES];
+	uint64_t bytes_sent;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t parse_errors;
+	int64_t active_connections;
+	int64_t queued;
+	int64_t outstanding;
+	uint64_t latency[ROUTES][LATENCY_BUCKETS];
+	uint64_t latency_count[ROUTES];
+	uint64_t latency_sum_us[ROUTES];
+};
+
+void metrics_sum(metrics_totals_t &totals) {
+	memset(&totals, 0, sizeof(totals));
+	// The retired slot included
+	for(int i = 0; i <= metrics_slot_count && metrics_slots; ++i) {
+		worker_metrics_t &slot = metrics_slots[i];
+		for(int m = 0; m <= UNKNOWN; ++m) {
+			for(int s = 0; s < METRICS_STATUSES; ++s) {
+				totals.requests[m][s] += slot.requests[m][s].load(std::memory_order_relaxed);
+			}
+		}
+		totals.bytes_sent += slot.bytes_sent.load(std::memory_order_relaxed);
+		totals.cache_hits += slot.cache_hits.load(std::memory_order_relaxed);
+		totals.cache_misses += slot.cache_misses.load(std::memory_order_relaxed);
+		totals.parse_errors += slot.parse_errors.load(std::memory_order_relaxed);
+		if(slot.pid.load(std::memory_order_relaxed) != 0) {
+			totals.active_connections += slot.active_connections.load(std::memory_order_relaxed);
+			totals.queued += metrics_queued(slot);
+			totals.outstanding += metrics_outstanding(slot);
+		}
+		for(int r = 0; r < ROUTES; ++r) {
+			for(int b = 0; b < LATENCY_BUCKETS; ++b) {
+				uint64_t count = slot.latency[r].buckets[b].load(std::memory_order_relaxed);
+				totals.latency[r][b] += count;
+				totals.latency_count[r] += count;
+			}
+			totals.latency_sum_us[r] += slot.latency[r].sum_us.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+uint64_t latency_quantile(const metrics_totals_t &totals, int route, double quantile) {
+	uint64_t rank = (uint64_t)(quantile * totals.latency_count[route] + 0.5);
+	uint64_t seen = 0;
+	for(int b = 0; b < LATENCY_BUCKETS; ++b) {
+		seen += totals.latency[route][b];
+		if(seen >= rank && seen > 0) {
+			return latency_bucket_limit(b);
+		}
+	}
+	return 0;
+}
+
+void append_format(string &out, const char *format, ...) {
+	char line[512];
+	va_list args;
+	va_start(args, format);
+	int size = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	out.append(line, min(size, (int)sizeof(line) - 1));
+}
+
+void render_stats_json(string &body) {
+	metrics_totals_t totals;
+	metrics_sum(totals);
+
+	append_format(body, "{\n\t\"requests\": {");
+	const char *separator = "";
+	for(int m = 0; m <= UNKNOWN; ++m) {
+		for(int s = 0; s < METRICS_STATUSES; ++s) {
+			if(totals.requests[m][s] == 0) {
+				continue;
+			}
+			char status[8];
+			snprintf(status, sizeof(status), metrics_statuses[s] ? "%d" : "other", metrics_statuses[s]);
+			append_format(body, "%s\n\t\t\"%s %s\": %llu", separator, method_names[m], status, (unsigned long long)totals.requests[m][s]);
+			separator = ",";
+		}
+	}
+	append_format(body, "\n\t},\n");
+	append_format(body, "\t\"bytes_sent\": %llu,\n", (unsigned long long)totals.bytes_sent);
+	append_format(body, "\t\"cache_hits\": %llu,\n", (unsigned long long)totals.cache_hits);
+	append_format(body, "\t\"cache_misses\": %llu,\n", (unsigned long long)totals.cache_misses);
+	append_format(body, "\t\"parse_errors\": %llu,\n", (unsigned long long)totals.parse_errors);
+	append_format(body, "\t\"active_connections\": %lld,\n", (long long)totals.active_connections);
+	append_format(body, "\t\"queued_fds\": %lld,\n", (long long)totals.queued);
+	append_format(body, "\t\"outstanding\": %lld,\n", (long long)totals.outstanding);
+
+	append_format(body, "\t\"latency_us\": {");
+	for(int r = 0; r < ROUTES; ++r) {
+		uint64_t count = totals.latency_count[r];
+		append_format(body, "%s\n\t\t\"%s\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}",
+			r ? "," : "", route_names[r], (unsigned long long)count,
+			(unsigned long long)(count ? totals.latency_sum_us[r] / count : 0),
+			(unsigned long long)latency_quantile(totals, r, 0.5),
+			(unsigned long long)latency_quantile(totals, r, 0.9),
+			(unsigned long long)latency_quantile(totals, r, 0.99),
+			(unsigned long long)latency_quantile(totals, r, 1.0));
+	}
+	append_format(body, "\n\t},\n");
+
+	append_format(body, "\t\"workers\": [");
+	separator = "";
+	for(int i = 0; i < metrics_slot_count; ++i) {
+		worker_metrics_t &slot = metrics_slots[i];
+		pid_t pid = slot.pid.load(std::memory_order_relaxed);
+		if(pid == 0) {
+			continue;
+		}
+		append_format(body, "%s\n\t\t{\"pid\": %d, \"active_connections\": %lld, \"queued_fds\": %lld, \"outstanding\": %lld, \"handed_off\": %llu}", separator, pid,
+			(long long)slot.active_connections.load(std::memory_order_relaxed),
+			(long long)metrics_queued(slot),
+			(long long)metrics_outstanding(slot),
+			(unsigned long long)slot.handed_off.load(std::memory_order_relaxed));
+		separator = ",";
+	}
+	append_format(body, "\n\t]\n}\n");
+}
+
+void render_stats_prometheus(string &body) {
+	metrics_totals_t totals;
+	metrics_sum(totals);
+
+	body += "# TYPE webserver_requests_total counter\n";
+	for(int m = 0; m <= UNKNOWN; ++m) {
+		for(int s = 0; s < METRICS_STATUSES; ++s) {
+			if(totals.requests[m][s] == 0) {
+				continue;
+			}
+			char status[8];
+			snprintf(status, sizeof(status), metrics_statuses[s] ? "%d" : "other", metrics_statuses[s]);
+			append_format(body, "webserver_requests_total{method=\"%s\",status=\"%s\"} %llu\n", method_names[m], status, (unsigned long long)totals.requests[m][s]);
+		}
+	}
+
+	append_format(body, "# TYPE webserver_sent_bytes_total counter\nwebserver_sent_bytes_total %llu\n", (unsigned long long)totals.bytes_sent);
+	append_format(body, "# TYPE webserver_cache_hits_total counter\nwebserver_cache_hits_total %llu\n", (unsigned long long)totals.cache_hits);
+	append_format(body, "# TYPE webserver_cache_misses_total counter\nwebserver_cache_misses_total %llu\n", (unsigned long long)totals.cache_misses);
+	append_format(body, "# TYPE webserver_parse_errors_total counter\nwebserver_parse_errors_total %llu\n", (unsigned long long)totals.parse_errors);
+
+	body += "# TYPE webserver_active_connections gauge\n";
+	for(int i = 0; i < metrics_slot_count; ++i) {
+		pid_t pid = metrics_slots[i].pid.load(std::memory_order_relaxed);
+		if(pid != 0) {
+			append_format(body, "webserver_active_connections{worker=\"%d\"} %lld\n", pid, (long long)metrics_slots[i].active_connections.load(std::memory_order_relaxed));
+		}
+	}
+
+	body += "# TYPE webserver_queued_fds gauge\n";
+	for(int i = 0; i < metrics_slot_count; ++i) {
+		worker_metrics_t &slot = metrics_slots[i];
+		pid_t pid = slot.pid.load(std::memory_order_relaxed);
+		if(pid != 0) {
+			append_format(body, "webserver_queued_fds{worker=\"%d\"} %lld\n", pid, (long long)metrics_queued(slot));
+		}
+	}
+
+	body += "# TYPE webserver_outstanding_requests gauge\n";
+	for(int i = 0; i < metrics_slot_count; ++i) {
+		worker_metrics_t &slot = metrics_slots[i];
+		pid_t pid = slot.pid.load(std::memory_order_relaxed);
+		if(pid != 0) {
+			append_format(body, "webserver_outstanding_requests{worker=\"%d\"} %lld\n", pid, (long long)metrics_outstanding(slot));
+		}
+	}
+
+	body += "# TYPE webserver_handed_off_total counter\n";
+	for(int i = 0; i < metrics_slot_count; ++i) {
+		worker_metrics_t &slot = metrics_slots[i];
+		pid_t pid = slot.pid.load(std::memory_order_relaxed);
+		if(pid != 0) {
+			append_format(body, "webserver_handed_off_total{worker=\"%d\"} %llu\n", pid, (unsigned long long)slot.handed_off.load(std::memory_order_relaxed));
+		}
+	}
+
+	// Prometheus buckets at powers of two, cumulative
+	body += "# TYPE webserver_request_duration_microseconds histogram\n";
+	for(int r = 0; r < ROUTES; ++r) {
+		uint64_t cumulative = 0;
+		int b = 0;
+		for(int exponent = LATENCY_SUB_BITS; exponent <= LATENCY_MAX_EXPONENT; ++exponent) {
+			uint64_t limit = (1ULL << exponent) - 1;
+			while(b < LATENCY_BUCKETS && latency_bucket_limit(b) <= limit) {
+				cumulative += totals.latency[r][b++];
+			}
+			append_format(body, "webserver_request_duration_microseconds_bucket{route=\"%s\",le=\"%llu\"} %llu\n", route_names[r], (unsigned long long)limit, (unsigned long long)cumulative);
+		}
+		append_format(body, "webserver_request_duration_microseconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n", route_names[r], (unsigned long long)totals.latency_count[r]);
+		append_format(body, "webserver_request_duration_microseconds_sum{route=\"%s\"} %llu\n", route_names[r], (unsigned long long)totals.latency_sum_us[r]);
+		append_format(body, "webserver_request_duration_microseconds_count{route=\"%s\"} %llu\n", route_names[r], (unsigned long long)totals.latency_count[r]);
+	}
+}
+
+/*
+	WORKER QUEUES
+
+	The master's ends of the socketpairs are non-blocking, so a worker
+	that does not read its socket can not stall the master. Messages its
+	socket does not take (connections in fdpass mode, cache updates) wait
+	in its queue, in order, until the socket reports EPOLLOUT. A worker
+	with a queue is stalled: choose_worker() passes new connections to the
+	others.
+*/
+struct queued_message_t {
+	channel_message_t message;
+	int fd;             // the connection, or the memfd of a cache update
+};
+
+struct worker_queue_t {
+	std::deque<queued_message_t> messages;
+	bool waiting;       // EPOLLOUT armed on the socket
+
+	worker_queue_t() : waiting(false) {}
+};
+
+vector<worker_queue_t> worker_queues;   // parallel to master_vars.sockets
+
+bool worker_stalled(int index) {
+	return !worker_queues[index].messages.empty();
+}
+
+/*
+	Waits for the next request on a connection the master holds
+*/
+void watch_connection(int epoll, int fd, int requests, uint32_t peer) {
+	struct epoll_event event;
+	event.data.fd = fd;
+	event.events = EPOLLIN;
+	epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+
+	keep_alive_t state = {requests, time(NULL), peer};
+	master_vars.connections[fd] = state;
+}
+
+/*
+	Takes back a message the worker will not get: a connection is watched
+	again, so its next readiness passes it to another worker
+*/
+void release_message(int worker, const queued_message_t &queued) {
+	if(queued.message.type == CACHE_UPDATE) {
+		close(queued.fd);
+		return;
+	}
+
+	int slot = master_vars.slots[worker];
+	if(slot != -1) {
+		metrics_slots[slot].handed_off.fetch_sub(1, std::memory_order_relaxed);
+	}
+	if(master_vars.drain_deadline != 0) {
+		close(queued.fd);
+	} else {
+		watch_connection(master_vars.epoll, queued.fd, queued.message.requests, queued.message.peer);
+	}
+}
+
+void queue_message(int worker, const channel_message_t &message, int fd) {
+	queued_message_t queued = {message, fd};
+	worker_queues[worker].messages.push_back(queued);
+}
+
+/*
+	Sends what the socket takes of the worker's queue; the master closes
+	its copies of the descriptors sent
+*/
+void flush_worker(int worker) {
+	worker_queue_t &queue = worker_queues[worker];
+	int socket = master_vars.sockets[worker];
+
+	while(!queue.messages.empty()) {
+		channel_message_t messages[HANDOFF_BATCH_MAX];
+		int fds[HANDOFF_BATCH_MAX];
+		int count = min((int)queue.messages.size(), HANDOFF_BATCH_MAX);
+		uint64_t sent_us = now_us();
+		for(int i = 0; i < count; ++i) {
+			messages[i] = queue.messages[i].message;
+			messages[i].sent_us = sent_us;
+			fds[i] = queue.messages[i].fd;
+		}
+
+		ssize_t size = sock_fds_write(socket, messages, fds, count);
+		if(size == -1 && errno == EAGAIN) {
+			break;
+		}
+
+		for(int i = 0; i < count; ++i) {
+			if(size > 0) {
+				close(fds[i]);
+			} else {
+				release_message(worker, queue.messages.front());
+			}
+			queue.messages.pop_front();
+		}
+	}
+
+	bool waiting = !queue.messages.empty();
+	if(waiting != queue.waiting) {
+		struct epoll_event event;
+		event.data.fd = socket;
+		event.events = waiting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		epoll_ctl(master_vars.epoll, EPOLL_CTL_MOD, socket, &event);
+		queue.waiting = waiting;
+	}
+}
+
+/*
+	Receives one message. Returns the number of entries, each with its
+	descriptor in fds (-1 if it did not arrive), 0 when the other side has
+	gone and -1 when interrupted.
+*/
+int sock_fds_read(int socket, channel_message_t *messages, int *fds) {
+	struct msghdr msg;
+	struct iovec iov;
+
+	union {
+		struct cmsghdr cmsghdr;
+		char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH_MAX)];
+	} cmsgu;
+
+	iov.iov_base = messages;
+	iov.iov_len = sizeof(channel_message_t) * HANDOFF_BATCH_MAX;
+
+	msg.msg_name = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_flags = 0;
+
+	msg.msg_control = cmsgu.control;
+	msg.msg_controllen = sizeof(cmsgu.control);
+
+	ssize_t size = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+
+	if(size < 0) {
+		if(errno == EINTR || errno == EAGAIN) {
+			return -1;
+		}
+		log_error << "recvmsg error: " << errno << endl;
+		log_error << strerror(errno) << endl;
+		return 0;
+	}
+
+	int count = size / sizeof(channel_message_t);
+	for(int i = 0; i < count; ++i) {
+		fds[i] = -1;
+	}
+
+	if(msg.msg_flags & MSG_CTRUNC) {
+		log_warn << "recvmsg: descriptors truncated" << endl;
+	}
+
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			log_error << "Invalid cmsg " << cmsg->cmsg_level << "/" << cmsg->cmsg_type << endl;
+			continue;
+		}
+		int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *received_fds = (int *)CMSG_DATA(cmsg);
+		for(int i = 0; i < received; ++i) {
+			if(i < count) {
+				fds[i] = received_fds[i];
+			} else {
+				close(received_fds[i]);
+			}
+		}
+	}
+
+	return count;
+}
+
+/*
+	CACHE INVALIDATION
+
+	The master watches the served directory tree with inotify. A file that
+	was written (IN_CLOSE_WRITE) or moved in is loaded into a new blob first,
+	on the builder thread (see CACHE BUILDER); only then the master swaps its
+	own entry and passes the blob to every worker, which swaps its entry too. Until then workers keep serving the
+	old bytes, and responses in flight keep the old mapping alive. Removed
+	files are propagated as tombstone blobs. If the inotify queue overflows
+	(IN_Q_OVERFLOW), events were lost: the master watches the tree again and
+	republishes every file in it and every cached path, so files that are
+	gone get tombstones.
+*/
+#define CACHE_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+
+std::map<int, string> cache_watches;
+
+void cache_watch_directory(int inotify, const string &directory, const string &path) {
+	int wd = inotify_add_watch(inotify, (directory + path).c_str(), CACHE_WATCH_MASK);
+	if(wd == -1) {
+		log_error << "inotify_add_watch '" << directory + path << "' error: " << strerror(errno) << endl;
+		return;
+	}
+	cache_watches[wd] = path;
+
+	DIR *dir = opendir((directory + path).c_str());
+	if(!dir) {
+		return;
+	}
+
+	struct dirent *item;
+	while((item = readdir(dir)) != NULL) {
+		if(strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+			continue;
+		}
+		string item_path = path + "/" + item->d_name;
+		struct stat item_stat;
+		if(stat((directory + item_path).c_str(), &item_stat) == 0 && S_ISDIR(item_stat.st_mode)) {
+			cache_watch_directory(inotify, directory, item_path);
+		}
+	}
+
+	closedir(dir);
+}
+
+int cache_watch() {
+	if(global_args.cache_size == 0) {
+		return -1;
+	}
+
+	int inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotify == -1) {
+		log_error << "inotify_init1 error: " << strerror(errno) << endl;
+		return -1;
+	}
+
+	cache_watch_directory(inotify, cache_directory(), "");
+
+	log_info << "Cache: watching " << cache_watches.size() << " directories" << endl;
+
+	return inotify;
+}
+
+int cache_create_tombstone(const string &path) {
+	if(path.size() >= PATH_MAX) {
+		return -1;
+	}
+
+	cache_blob_t blob;
+	memset(&blob, 0, sizeof(blob));
+	strcpy(blob.path, path.c_str());
+	blob.removed = 1;
+
+	int memfd = memfd_create("webserver-cache", MFD_CLOEXEC);
+	if(memfd == -1) {
+		log_error << "memfd_create error: " << strerror(errno) << endl;
+		return -1;
+	}
+
+	if(write(memfd, &blob, sizeof(blob)) != sizeof(blob)) {
+		close(memfd);
+		return -1;
+	}
+
+	return memfd;
+}
+
+/*
+	Replaces (or drops, for a tombstone) the entry described by a blob
+*/
+void cache_apply(int memfd) {
+	string path;
+	cache_entry_ptr entry = cache_map_blob(memfd, &path);
+
+	if(path.empty()) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(file_cache_mutex, std::defer_lock);
+	if(global_args.threads > 1) {
+		lock.lock();
+	}
+	cache_store(path, entry);
+
+	log_info << "Cache: " << (entry ? "updated " : "removed ") << path << endl;
+}
+
+/*
+	Applies a blob in the master and passes it to every worker
+*/
+void cache_broadcast(int memfd) {
+	cache_apply(memfd);
+
+	channel_message_t message;
+	memset(&message, 0, sizeof(message));
+	message.type = CACHE_UPDATE;
+	for(int i = 0; i < master_vars.sockets.size(); ++i) {
+		int copy = fcntl(memfd, F_DUPFD_CLOEXEC, 0);
+		if(copy == -1) {
+			log_error << "Cache: can't pass an update to worker " << i << ": " << strerror(errno) << endl;
+			continue;
+		}
+		queue_message(i, message, copy);
+		flush_worker(i);
+	}
+
+	close(memfd);
+}
+
+string cache_clock_hand;    // path of the entry CLOCK looked at last
+
+/*
+	Evicts entries until a blob of size bytes fits in place of the entry
+	for keep (if any). CLOCK: entries are visited in path order from the
+	hand; one served since the last visit has its flag cleared and stays,
+	the others are evicted. Returns false if two turns do not free
+	enough.
+*/
+bool cache_make_room(const string &keep, size_t size) {
+	if(size > global_args.cache_size) {
+		return false;
+	}
+
+	file_cache_t::iterator kept = file_cache.find(keep);
+	size_t replaced = kept != file_cache.end() ? kept->second->map_size : 0;
+
+	size_t visits = 2 * file_cache.size();
+	while(file_cache_used - replaced + size > global_args.cache_size && visits-- > 0) {
+		file_cache_t::iterator it = file_cache.upper_bound(cache_clock_hand);
+		if(it == file_cache.end()) {
+			it = file_cache.begin();
+		}
+		cache_clock_hand = it->first;
+		if(it->first == keep || __atomic_exchange_n(it->second->referenced, 0, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		log_info << "Cache: evicting " << it->first << endl;
+		int memfd = cache_create_tombstone(it->first);
+		if(memfd == -1) {
+			break;
+		}
+		cache_broadcast(memfd);
+	}
+
+	return file_cache_used - replaced + size <= global_args.cache_size;
+}
+
+/*
+	Replaces the entry for path with a blob built from it, or drops the
+	entry when memfd is -1 or the blob does not fit, and passes the result
+	to the workers
+*/
+void cache_publish_blob(const string &path, int memfd) {
+	if(memfd != -1) {
+		struct stat blob_stat;
+		if(fstat(memfd, &blob_stat) == -1 || !cache_make_room(path, blob_stat.st_size)) {
+			close(memfd);
+			memfd = -1;
+		}
+	}
+
+	if(memfd == -1) {
+		if(file_cache.find(path) == file_cache.end()) {
+			return;
+		}
+		memfd = cache_create_tombstone(path);
+		if(memfd == -1) {
+			return;
+		}
+	}
+
+	cache_broadcast(memfd);
+}
+
+/*
+	CACHE BUILDER
+
+	Reading a changed file and compressing it (gzip and brotli at level 9)
+	takes milliseconds for the larger ones, and the master would not pass on
+	connections meanwhile. So the master only queues the path; a thread of
+	its own builds the blob and reports (path, memfd) through builder->done,
+	and the eventfd builder->wakeup wakes the master to publish it (see
+	cache_publish_blob), so budget, eviction and tombstones stay on the
+	master thread. A path waiting in the queue is not queued again. One
+	thread keeps the results of a path in the order of its changes.
+	Workers never touch the builder; they close the eventfd after fork().
+*/
+struct cache_build_t {
+	string path;
+	int memfd;          // -1: not cacheable (gone, too large, not a file)
+};
+
+struct cache_builder_t {
+	std::mutex lock;
+	std::condition_variable queued;
+	std::deque<string> paths;
+	std::set<string> pending;       // the paths in paths
+	vector<cache_build_t> done;
+	int wakeup;                     // eventfd
+};
+
+// NULL without a watched cache. Never freed: the thread runs until the
+// master exits.
+cache_builder_t *cache_builder = NULL;
+
+/*
+	Loads path from disk into a blob, -1 if it can not be cached
+*/
+int cache_build(const string &path) {
+	string directory = cache_directory();
+
+	struct stat file_stat;
+	bool cacheable = stat((directory + path).c_str(), &file_stat) == 0
+		&& S_ISREG(file_stat.st_mode)
+		&& file_stat.st_size <= CACHE_MAX_FILE_SIZE;
+
+	return cacheable ? cache_create_blob(path, directory + path) : -1;
+}
+
+void cache_build_thread() {
+	cache_builder_t &builder = *cache_builder;
+	while(1) {
+		string path;
+		{
+			std::unique_lock<std::mutex> lock(builder.lock);
+			while(builder.paths.empty()) {
+				builder.queued.wait(lock);
+			}
+			path = builder.paths.front();
+			builder.paths.pop_front();
+			builder.pending.erase(path);
+		}
+
+		cache_build_t build = {path, cache_build(path)};
+
+		bool first;
+		{
+			std::lock_guard<std::mutex> lock(builder.lock);
+			first = builder.done.empty();
+			builder.done.push_back(build);
+		}
+		if(first) {
+			uint64_t one = 1;
+			ssize_t written = write(builder.wakeup, &one, sizeof(one));
+			(void)written;
+		}
+	}
+}
+
+/*
+	Starts the builder thread. Returns the eventfd the master waits on, -1
+	if there is no builder.
+*/
+int cache_builder_start() {
+	int wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wakeup == -1) {
+		log_error << "Cache: eventfd error: " << strerror(errno) << endl;
+		return -1;
+	}
+	cache_builder = new cache_builder_t();
+	cache_builder->wakeup = wakeup;
+	std::thread(cache_build_thread).detach();
+	return wakeup;
+}
+
+/*
+	Reloads path from disk (or drops it) and pushes the result to the
+	workers, once the builder thread has loaded it
+*/
+void cache_publish(const string &path) {
+	if(cache_builder == NULL) {
+		cache_publish_blob(path, cache_build(path));
+		return;
+	}
+
+	cache_builder_t &builder = *cache_builder;
+	{
+		std::lock_guard<std::mutex> lock(builder.lock);
+		if(!builder.pending.insert(path).second) {
+			return;
+		}
+		builder.paths.push_back(path);
+	}
+	builder.queued.notify_one();
+}
+
+/*
+	Publishes the blobs the builder thread has finished
+*/
+void cache_builder_complete() {
+	cache_builder_t &builder = *cache_builder;
+	uint64_t count;
+	ssize_t result = read(builder.wakeup, &count, sizeof(count));
+	(void)result;
+
+	vector<cache_build_t> done;
+	{
+		std::lock_guard<std::mutex> lock(builder.lock);
+		done.swap(builder.done);
+	}
+	for(int i = 0; i < done.size(); ++i) {
+		cache_publish_blob(done[i].path, done[i].memfd);
+	}
+}
+
+/*
+	Returns the original of a sidecar path ("/index.html" for
+	"/index.html.gz"), "" for other paths
+*/
+string sidecar_original(const string &path) {
+	for(int encoding = ENCODING_GZIP; encoding < ENCODINGS; ++encoding) {
+		size_t suffix_size = strlen(encoding_suffixes[encoding]);
+		if(path.size() > suffix_size && path.compare(path.size() - suffix_size, suffix_size, encoding_suffixes[encoding]) == 0) {
+			return path.substr(0, path.size() - suffix_size);
+		}
+	}
+	return string();
+}
+
+void cache_publish_directory(const string &directory, const string &path) {
+	vector<pair<off_t, string> > files;
+	cache_collect_files(directory, path, files);
+	for(int i = 0; i < files.size(); ++i) {
+		cache_publish(files[i].second);
+	}
+}
+
+void cache_handle_events(int inotify) {
+	char events[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	string directory = cache_directory();
+
+	// A burst of events for one file (e.g. a copy) is published once
+	std::set<string> changed;
+	bool overflowed = false;
+
+	while(1) {
+		ssize_t size = read(inotify, events, sizeof(events));
+		if(size <= 0) {
+			break;
+		}
+
+		for(char *p = events; p < events + size; ) {
+			struct inotify_event *event = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + event->len;
+
+			if(event->mask & IN_Q_OVERFLOW) {
+				overflowed = true;
+				continue;
+			}
+
+			std::map<int, string>::iterator watch = cache_watches.find(event->wd);
+			if(watch == cache_watches.end()) {
+				continue;
+			}
+
+			if(event->mask & IN_IGNORED) {
+				cache_watches.erase(watch);
+				continue;
+			}
+
+			if(event->len == 0) {
+				continue;
+			}
+
+			string path = watch->second + "/" + event->name;
+
+			if(event->mask & IN_ISDIR) {
+				if(event->mask & (IN_CREATE | IN_MOVED_TO)) {
+					cache_watch_directory(inotify, directory, path);
+					cache_publish_directory(directory, path);
+				} else if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					string prefix = path + "/";
+					for(file_cache_t::iterator it = file_cache.lower_bound(prefix);
+						it != file_cache.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+						changed.insert(it->first);
+					}
+				}
+				continue;
+			}
+
+			if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)) {
+				changed.insert(path);
+
+				// A changed sidecar changes the variants of its original
+				string original = sidecar_original(path);
+				if(!original.empty() && file_cache.find(original) != file_cache.end()) {
+					changed.insert(original);
+				}
+			}
+		}
+	}
+
+	if(overflowed) {
+		log_info << "Cache: inotify queue overflowed, rescanning " << directory << endl;
+		cache_watch_directory(inotify, directory, "");
+
+		vector<pair<off_t, string> > files;
+		cache_collect_files(directory, "", files);
+		for(int i = 0; i < files.size(); ++i) {
+			changed.insert(files[i].second);
+		}
+		for(file_cache_t::iterator it = file_cache.begin(); it != file_cache.end(); ++it) {
+			changed.insert(it->first);
+		}
+	}
+
+	for(std::set<string>::iterator it = changed.begin(); it != changed.end(); ++it) {
+		cache_publish(*it);
+	}
+}
+
+/*
+	Part of a response sent after the current one: output is replaced with
+	header, then begin..end of the body (conn.body or conn.file_fd)
+*/
+struct body_part_t {
+	string header;
+	off_t begin;
+	off_t end;
+};
+
+/*
+	A response to a pipelined request, waiting to go out together with the
+	responses to the requests after it (see process_input())
+*/
+struct queued_response_t {
+	string header;
+	cache_entry_ptr cached;  // keeps body alive
+	const char *body;
+	size_t body_size;
+	access_record_t access;
+};
+
+/*
+	Connection served by a worker's event loop
+*/
+struct connection_t {
+	int fd;
+	bool owned;              // false: the master holds the connection between requests (fdpass mode)
+	bool keep_alive_allowed; // false: the master allows no more requests on the connection
+	bool keep_alive;         // the current response leaves the connection open
+	bool want_write;         // registered for EPOLLOUT
+	bool busy;               // a request thread is serving it (see WORK POOL)
+	int requests;
+	time_t last_active;
+	string input;            // received bytes not consumed by a request yet
+	http_parser_t parser;
+	string output;           // pending response header (and small bodies)
+	size_t output_offset;
+	cache_entry_ptr cached;  // keeps the cached body below alive
+	const char *body;        // in-memory body sent after output, bytes body_offset..body_end
+	size_t body_end;
+	size_t body_offset;
+	int file_fd;             // file sent after output, -1 if none
+	off_t file_offset;
+	off_t file_end;
+	vector<body_part_t> parts;  // further parts of a multipart/byteranges body
+	size_t part_index;
+	size_t sent;             // bytes of the current response written
+	std::deque<queued_response_t> queued;   // earlier responses, sent before this one
+	size_t queued_offset;    // bytes of the first queued response written
+	int pipe_fds[2];         // splice() pipe (fallback, or io_uring file sends), created on first use
+	size_t pipe_size;        // its capacity
+	size_t pipe_pending;     // bytes spliced into the pipe but not to the socket yet
+	access_record_t access;  // the current request
+};
+
+// IO_RING: the event loop sends the next file chunk through io_uring (see io_send_file)
+enum io_result {IO_DONE, IO_AGAIN, IO_ERROR, IO_RING};
+
+/*
+	Appends whatever the socket has to conn.input. Returns IO_AGAIN when
+	there is nothing to read and IO_ERROR when the peer has gone.
+*/
+io_result read_request(connection_t &conn) {
+	size_t input_size = conn.input.size();
+
+	conn.input.resize(input_size + BUFFER_SIZE);
+	int recv_result = recv(conn.fd, &conn.input[input_size], BUFFER_SIZE, MSG_NOSIGNAL);
+	conn.input.resize(input_size + (recv_result > 0 ? recv_result : 0));
+
+	log_debug << "PID " << getpid() << ": " << "fd = " << conn.fd << ", recv_result = " << recv_result << ", errno = " << errno << endl;
+
+	if(recv_result < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			return IO_AGAIN;
+		}
+		return IO_ERROR;
+	}
+
+	if(recv_result == 0) {
+		return IO_ERROR;
+	}
+
+	return IO_DONE;
+}
+
+void set_body_range(connection_t &conn, off_t begin, off_t end) {
+	if(conn.file_fd != -1) {
+		conn.file_offset = begin;
+		conn.file_end = end;
+	} else {
+		conn.body_offset = begin;
+		conn.body_end = end;
+	}
+}
+
+/*
+	Answers a Range request for the body already set on conn (conn.body or
+	conn.file_fd) of size bytes. Returns false when the whole body should
+	be sent instead. Several ranges of an encoded body are not split into
+	parts: the client gets the whole body.
+*/
+bool start_range_response(connection_t &conn, const string_view_t &path, off_t size, int encoding, time_t modified, const char *etag) {
+	vector<byte_range_t> ranges;
+	range_result result = parse_ranges(conn.parser.request, size, etag, modified, ranges);
+
+	if(result == RANGE_NONE || (result == RANGE_PARTIAL && ranges.size() > 1 && encoding != ENCODING_IDENTITY)) {
+		return false;
+	}
+
+	char line[128];
+
+	if(result == RANGE_UNSATISFIABLE) {
+		if(conn.file_fd != -1) {
+			close(conn.file_fd);
+			conn.file_fd = -1;
+		}
+		conn.cached.reset();
+		conn.body = NULL;
+		conn.access.status = 416;
+		conn.output.append(header_416.data, header_416.size);
+		snprintf(line, sizeof(line), "Content-Range: bytes */%lld\r\n", (long long)size);
+		conn.output += line;
+		append_content_length(conn.output, 0);
+		append_connection(conn.output, conn.keep_alive);
+		return true;
+	}
+
+	content_type _content_type = get_content_type(path);
+	const cache_policy_t *policy = cache_policy_find(path);
+
+	conn.access.status = 206;
+	conn.output.append(header_206.data, header_206.size);
+
+	if(ranges.size() == 1) {
+		conn.output += "Content-Type: ";
+		conn.output += get_content_type_name(_content_type);
+		conn.output += "\r\n";
+		if(encoding != ENCODING_IDENTITY) {
+			conn.output += "Content-Encoding: ";
+			conn.output += encoding_names[encoding];
+			conn.output += "\r\n";
+		}
+		snprintf(line, sizeof(line), "Content-Range: bytes %lld-%lld/%lld\r\n",
+			(long long)ranges[0].begin, (long long)ranges[0].end - 1, (long long)size);
+		conn.output += line;
+		append_content_length(conn.output, ranges[0].end - ranges[0].begin);
+		append_last_modified(conn.output, modified);
+		append_cache_headers(conn.output, _content_type, etag, policy);
+		append_expires(conn.output, policy ? policy->max_age : -1);
+		append_connection(conn.output, conn.keep_alive);
+		set_body_range(conn, ranges[0].begin, ranges[0].end);
+		return true;
+	}
+
+	static std::atomic<unsigned> multipart_responses(0);
+	char boundary[32];
+	snprintf(boundary, sizeof(boundary), "%08x%08x", (unsigned)getpid(), ++multipart_responses);
+
+	conn.parts.resize(ranges.size() + 1);
+	size_t content_length = 0;
+	for(int i = 0; i < ranges.size(); ++i) {
+		body_part_t &part = conn.parts[i];
+		snprintf(line, sizeof(line), "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+			boundary, get_content_type_name(_content_type), (long long)ranges[i].begin, (long long)ranges[i].end - 1, (long long)size);
+		part.header = line;
+		part.begin = ranges[i].begin;
+		part.end = ranges[i].end;
+		content_length += part.header.size() + part.end - part.begin;
+	}
+	body_part_t &closing = conn.parts[ranges.size()];
+	closing.header = string("\r\n--") + boundary + "--\r\n";
+	closing.begin = 0;
+	closing.end = 0;
+	content_length += closing.header.size();
+
+	conn.output += "Content-Type: multipart/byteranges; boundary=";
+	conn.output += boundary;
+	conn.output += "\r\n";
+	append_content_length(conn.output, content_length);
+	append_last_modified(conn.output, modified);
+	append_cache_headers(conn.output, _content_type, etag, policy);
+	append_expires(conn.output, policy ? policy->max_age : -1);
+	append_connection(conn.output, conn.keep_alive);
+
+	// The first part goes right after the response header
+	conn.output += conn.parts[0].header;
+	set_body_range(conn, conn.parts[0].begin, conn.parts[0].end);
+	conn.part_index = 1;
+	return true;
+}
+
+/*
+	HTTP-request handler
+
+	Takes the next complete request from conn.input and queues the whole
+	response into conn.output. Returns IO_AGAIN while the request is still
+	incomplete and IO_DONE when a response is ready to be written.
+*/
+
+io_result http_request_handler(connection_t &conn) {
+	int fd = conn.fd;
+
+	if(conn.input.empty()) {
+		return IO_AGAIN;
+	}
+
+	if(conn.access.received_us == 0) {
+		// A later request on a kept-alive connection
+		conn.access.received_us = now_us();
+		conn.access.woke_us = conn.access.received_us;
+		conn.access.handed_us = conn.access.received_us;
+	}
+
+	char * buffer = &conn.input[0];
+
+	parse_result _parse_result = http_parse(conn.parser, buffer, conn.input.size());
+
+	if(_parse_result == PARSE_AGAIN) {
+		return IO_AGAIN;
+	}
+
+	conn.access.parsed_us = now_us();
+
+	log_debug << "FD " << fd << ": http_request_handler" << endl;
+
+	++conn.requests;
+
+	conn.output.clear();
+	conn.output_offset = 0;
+
+	if(_parse_result == PARSE_ERROR) {
+		log_debug << "Bad request!" << endl;
+		METRICS_ADD(parse_errors, 1);
+		conn.keep_alive = false;
+		conn.access.status = 400;
+		append_header(conn.output, header_400, body_400.size, false);
+		conn.output.append(body_400.data, body_400.size);
+		conn.input.clear();
+		http_parser_reset(conn.parser);
+		return IO_DONE;
+	}
+
+	int request_size = conn.parser.request_end;
+
+	log_debug << "===header===" << endl;
+	log_debug.write(buffer, conn.parser.header_end);
+	log_debug << "============" << endl;
+
+	const http_request_t &request = conn.parser.request;
+	method _method = request._method;
+
+	conn.keep_alive = conn.keep_alive_allowed
+		&& conn.requests < global_args.keep_alive_max_requests
+		&& is_keep_alive(request);
+
+	const string_view_t &file_path = request.path;
+
+	log_debug << "file_path = '" << string(file_path.data, file_path.size) << "', keep_alive = " << conn.keep_alive << endl;
+
+	conn.access.request_method = _method;
+	access_record_path(conn.access, file_path);
+
+	switch(_method) {
+		case GET: {
+			if(view_equals(file_path, route_stats) || view_equals(file_path, route_metrics)) {
+				bool prometheus = view_equals(file_path, route_metrics);
+				string stats;
+				if(prometheus) {
+					render_stats_prometheus(stats);
+				} else {
+					render_stats_json(stats);
+				}
+				conn.access.route = ROUTE_STATS;
+				conn.access.status = 200;
+				append_header(conn.output, prometheus ? header_200_text_plain_metrics : header_200_application_json, stats.size(), conn.keep_alive);
+				conn.output += stats;
+				break;
+			}
+
+			string_view_t request_path = file_path;
+			if(view_equals(file_path, root_directory)) {
+				request_path.data = default_page;
+				request_path.size = strlen(default_page);
+			}
+
+			cache_entry_ptr cached = cache_lookup(request_path);
+
+			if(cached) {
+				METRICS_ADD(cache_hits, 1);
+				cache_entry_t &entry = *cached;
+				cache_touch(entry);
+
+				int encoding = ENCODING_IDENTITY;
+				if(entry.encodings != 1 << ENCODING_IDENTITY) {
+					encoding = preferred_encoding(entry.encodings & accepted_encodings(request));
+				}
+				const cache_variant_t &variant = entry.variants[encoding];
+
+				if(request_not_modified(request, variant.etag, entry.modified)) {
+					conn.access.status = 304;
+					conn.output.append(variant.not_modified, variant.not_modified_size);
+					append_expires(conn.output, entry.max_age);
+					append_connection(conn.output, conn.keep_alive);
+					break;
+				}
+				conn.cached = cached;
+				conn.body = variant.body;
+				if(start_range_response(conn, request_path, variant.body_size, encoding, entry.modified, variant.etag)) {
+					break;
+				}
+
+				conn.access.status = 200;
+				conn.output.append(variant.header, variant.header_size);
+				append_expires(conn.output, entry.max_age);
+				append_connection(conn.output, conn.keep_alive);
+				conn.body_offset = 0;
+				conn.body_end = variant.body_size;
+				break;
+			}
+
+			METRICS_ADD(cache_misses, 1);
+
+			string full_file_path(global_args.directory);
+			full_file_path.append(request_path.data, request_path.size);
+
+			log_debug << "full_file_path = '" << full_file_path << "'" << endl;
+
+			int file_fd = open(full_file_path.c_str(), O_RDONLY);
+			struct stat file_stat;
+
+			if(file_fd != -1 && fstat(file_fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+				content_type _content_type = get_content_type(request_path);
+				int encoding = ENCODING_IDENTITY;
+				off_t body_size = file_stat.st_size;
+
+				// Uncached text is only sent encoded from a sidecar file
+				if(content_type_compressible(_content_type)) {
+					int accepted = accepted_encodings(request);
+					for(int candidate = ENCODINGS - 1; candidate > ENCODING_IDENTITY; --candidate) {
+						struct stat sidecar_stat;
+						int sidecar_fd = (accepted & (1 << candidate)) ? open_sidecar(full_file_path, candidate, file_stat, &sidecar_stat) : -1;
+						if(sidecar_fd != -1) {
+							close(file_fd);
+							file_fd = sidecar_fd;
+							body_size = sidecar_stat.st_size;
+							encoding = candidate;
+							break;
+						}
+					}
+				}
+
+				char etag[ETAG_SIZE];
+				render_etag(etag, sizeof(etag), file_stat, encoding);
+				const cache_policy_t *policy = cache_policy_find(request_path);
+
+				if(request_not_modified(request, etag, file_stat.st_mtime)) {
+					close(file_fd);
+					conn.access.status = 304;
+					render_not_modified_header(conn.output, _content_type, file_stat, etag, policy);
+					append_expires(conn.output, policy ? policy->max_age : -1);
+					append_connection(conn.output, conn.keep_alive);
+					break;
+				}
+
+				// The body goes straight from the page cache to the socket
+				conn.file_fd = file_fd;
+				if(start_range_response(conn, request_path, body_size, encoding, file_stat.st_mtime, etag)) {
+					break;
+				}
+
+				conn.access.status = 200;
+				render_file_header(conn.output, _content_type, file_stat, encoding, body_size, etag, policy);
+				append_expires(conn.output, policy ? policy->max_age : -1);
+				append_connection(conn.output, conn.keep_alive);
+				conn.file_offset = 0;
+				conn.file_end = body_size;
+			} else {
+				if(file_fd != -1) {
+					close(file_fd);
+				}
+				log_debug << "File '" << full_file_path << "' not found" << endl;
+				conn.access.status = 404;
+				append_header(conn.output, header_404, 0, conn.keep_alive);
+			}
+
+			break;
+		}
+		case POST: {
+
+			conn.access.route = ROUTE_CALC;
+
+			if(!view_equals(file_path, route_calc)) {
+				conn.access.status = 404;
+				append_header(conn.output, header_404, 0, conn.keep_alive);
+			} else {
+
+				int body_begin_index = conn.parser.header_end;
+
+				int calc_result = calc(buffer, request_size, &body_begin_index);
+
+				char json_result[64];
+				int json_size = snprintf(json_result, sizeof(json_result), "{\n\t\"result\": %d\n}", calc_result);
+
+				conn.access.status = 200;
+				append_header(conn.output, header_200_application_json, json_size, conn.keep_alive);
+				conn.output.append(json_result, json_size);
+			}
+			break;
+		}
+		default: {
+			break;
+		}
+	}
+
+	// Bytes after the request belong to the next one
+	conn.input.erase(0, request_size);
+	http_parser_reset(conn.parser);
+
+	return IO_DONE;
+}
+
+std::atomic<bool> sendfile_unsupported(false);
+// Set by a worker whose backend is io_uring: file bodies go out through
+// linked splice requests (see io_send_file) instead of sendfile()
+std::atomic<bool> ring_file_sends(false);
+
+bool open_pipe(connection_t &conn) {
+	if(conn.pipe_fds[0] != -1) {
+		return true;
+	}
+	if(pipe2(conn.pipe_fds, O_NONBLOCK) == -1) {
+		log_error << "FD " << conn.fd << ": pipe error: " << strerror(errno) << endl;
+		return false;
+	}
+	int size = fcntl(conn.pipe_fds[1], F_SETPIPE_SZ, SEND_CHUNK_SIZE);
+	if(size == -1) {
+		size = fcntl(conn.pipe_fds[1], F_GETPIPE_SZ);
+	}
+	conn.pipe_size = size > 0 ? size : 4096;
+	return true;
+}
+
+/*
+	Moves the next part of conn.file_fd to the socket with splice() through
+	a pipe. Used where sendfile() can not send from this file to a socket.
+*/
+ssize_t splice_file(connection_t &conn) {
+	if(!open_pipe(conn)) {
+		return -1;
+	}
+
+	if(conn.pipe_pending == 0) {
+		ssize_t filled = splice(conn.file_fd, &conn.file_offset, conn.pipe_fds[1], NULL, min(conn.file_end - conn.file_offset, (off_t)SEND_CHUNK_SIZE), SPLICE_F_MOVE);
+		if(filled <= 0) {
+			return -1;
+		}
+		conn.pipe_pending = filled;
+	}
+
+	ssize_t sent = splice(conn.pipe_fds[0], NULL, conn.fd, NULL, conn.pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if(sent > 0) {
+		conn.pipe_pending -= sent;
+	}
+	return sent;
+}
+
+ssize_t send_file(connection_t &conn) {
+	if(!sendfile_unsupported) {
+		ssize_t sent = sendfile(conn.fd, conn.file_fd, &conn.file_offset, min(conn.file_end - conn.file_offset, (off_t)SEND_CHUNK_SIZE));
+		if(sent == 0) {
+			// the file was truncated under us
+			errno = EIO;
+			return -1;
+		}
+		if(sent != -1 || (errno != EINVAL && errno != ENOSYS)) {
+			return sent;
+		}
+		log_warn << "sendfile is not supported, falling back to splice" << endl;
+		sendfile_unsupported = true;
+	}
+	return splice_file(conn);
+}
+
+void finish_access_record(const access_record_t &record, size_t bytes) {
+	uint64_t sent_us = now_us();
+	metrics_count_request(record, bytes, elapsed_us(record.woke_us, sent_us));
+	if(global_args.access_log) {
+		access_log_write(record, bytes, sent_us);
+	}
+}
+
+/*
+	Adds data to msg, less the first *skip bytes already written
+*/
+void add_iovec(struct msghdr &msg, const char *data, size_t size, size_t *skip) {
+	if(*skip >= size) {
+		*skip -= size;
+		return;
+	}
+	msg.msg_iov[msg.msg_iovlen].iov_base = (void *)(data + *skip);
+	msg.msg_iov[msg.msg_iovlen].iov_len = size - *skip;
+	++msg.msg_iovlen;
+	*skip = 0;
+}
+
+/*
+	Takes sent bytes off the queued responses, completing those written in
+	full. Returns the bytes left for the current response.
+*/
+size_t complete_queued(connection_t &conn, size_t sent) {
+	while(!conn.queued.empty() && sent > 0) {
+		queued_response_t &response = conn.queued.front();
+		size_t left = response.header.size() + response.body_size - conn.queued_offset;
+		if(sent < left) {
+			conn.queued_offset += sent;
+			return 0;
+		}
+		sent -= left;
+		conn.queued_offset = 0;
+		finish_access_record(response.access, response.header.size() + response.body_size);
+		conn.queued.pop_front();
+	}
+	return sent;
+}
+
+/*
+	Writes the current part of the response: the queued pipelined responses,
+	the header from conn.output and an in-memory body in one sendmsg(), then
+	the file with sendfile() (the header goes with MSG_MORE, so it shares a
+	packet with the start of the file). At most SEND_CHUNK_SIZE file bytes
+	go out per call, so a fast reader of a big file does not hold up the
+	other connections: IO_AGAIN brings it back on the next EPOLLOUT. With
+	io_uring the file is left to the event loop: IO_RING.
+*/
+io_result flush_part(connection_t &conn) {
+	int flags = (conn.file_fd != -1) ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+
+	while(!conn.queued.empty() || conn.output_offset < conn.output.size() || conn.body_offset < conn.body_end) {
+		struct iovec iov[2 * PIPELINE_BATCH_MAX + 2];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+
+		size_t skip = conn.queued_offset;
+		for(int i = 0; i < conn.queued.size(); ++i) {
+			add_iovec(msg, conn.queued[i].header.data(), conn.queued[i].header.size(), &skip);
+			add_iovec(msg, conn.queued[i].body, conn.queued[i].body_size, &skip);
+		}
+
+		if(conn.output_offset < conn.output.size()) {
+			iov[msg.msg_iovlen].iov_base = (void *)(conn.output.data() + conn.output_offset);
+			iov[msg.msg_iovlen].iov_len = conn.output.size() - conn.output_offset;
+			++msg.msg_iovlen;
+		}
+		if(conn.body_offset < conn.body_end) {
+			iov[msg.msg_iovlen].iov_base = (void *)(conn.body + conn.body_offset);
+			iov[msg.msg_iovlen].iov_len = conn.body_end - conn.body_offset;
+			++msg.msg_iovlen;
+		}
+
+		ssize_t sent = sendmsg(conn.fd, &msg, flags);
+		if(sent < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return IO_AGAIN;
+			}
+			log_debug << "FD " << conn.fd << ": send error: " << strerror(errno) << endl;
+			return IO_ERROR;
+		}
+
+		sent = complete_queued(conn, sent);
+		conn.sent += sent;
+		size_t output_sent = min((size_t)sent, conn.output.size() - conn.output_offset);
+		conn.output_offset += output_sent;
+		conn.body_offset += sent - output_sent;
+	}
+
+	if(conn.file_fd == -1) {
+		return IO_DONE;
+	}
+
+	if(ring_file_sends) {
+		if(conn.file_offset == conn.file_end && conn.pipe_pending == 0) {
+			return IO_DONE;
+		}
+		return open_pipe(conn) ? IO_RING : IO_ERROR;
+	}
+
+	size_t chunk = 0;
+	while(conn.file_offset < conn.file_end || conn.pipe_pending > 0) {
+		if(chunk >= SEND_CHUNK_SIZE) {
+			return IO_AGAIN;
+		}
+		ssize_t sent = send_file(conn);
+		if(sent < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				return IO_AGAIN;
+			}
+			log_debug << "FD " << conn.fd << ": sendfile error: " << strerror(errno) << endl;
+			return IO_ERROR;
+		}
+		conn.sent += sent;
+		chunk += sent;
+	}
+
+	return IO_DONE;
+}
+
+/*
+	Accounts an io_uring file send: filled bytes went from the file into
+	the pipe, sent of those in the pipe went to the socket
+*/
+void complete_file_send(connection_t &conn, size_t filled, size_t sent) {
+	conn.file_offset += filled;
+	conn.pipe_pending += filled - sent;
+	conn.sent += sent;
+}
+
+/*
+	Writes as much of the pending response as the socket accepts, moving on
+	through the queued multipart parts
+*/
+io_result flush_output(connection_t &conn) {
+	while(1) {
+		io_result result = flush_part(conn);
+		if(result != IO_DONE) {
+			return result;
+		}
+		if(conn.part_index == conn.parts.size()) {
+			break;
+		}
+
+		body_part_t &part = conn.parts[conn.part_index++];
+		conn.output.swap(part.header);
+		conn.output_offset = 0;
+		set_body_range(conn, part.begin, part.end);
+	}
+
+	conn.parts.clear();
+	conn.part_index = 0;
+
+	if(conn.file_fd != -1) {
+		close(conn.file_fd);
+		conn.file_fd = -1;
+	}
+
+	return IO_DONE;
+}
+
+/*
+	Closes keep-alive connections idle for longer than the keep-alive timeout
+*/
+void close_idle_connections(std::map<int, keep_alive_t> &connections, int epoll) {
+	time_t now = time(NULL);
+	std::map<int, keep_alive_t>::iterator it = connections.begin();
+	while(it != connections.end()) {
+		if(now - it->second.last_active >= global_args.keep_alive_timeout) {
+			log_debug << "FD " << it->first << ": keep-alive timeout" << endl;
+			epoll_ctl(epoll, EPOLL_CTL_DEL, it->first, NULL);
+			shutdown(it->first, SHUT_RDWR);
+			close(it->first);
+			connections.erase(it++);
+		} else {
+			++it;
+		}
+	}
+}
+
+/*
+	CPU AFFINITY
+
+	With -k every worker is pinned: the worker at position p (see
+	free_position) runs on affinity.cpus[p % size]. "auto" takes the CPUs
+	the server may run on, grouped by NUMA node, so workers fill one node
+	before the next. A worker with request threads (-j) is pinned to all
+	the CPUs of its node instead: its threads spread but stay next to its
+	memory. Workers pin themselves right after fork(), before they touch
+	any memory of their own, so it comes from their node.
+*/
+struct affinity_t {
+	vector<int> cpus;
+	vector<int> nodes;      // NUMA node of cpus[i]
+} affinity;
+
+/*
+	Parses a CPU list in the kernel format, e.g. "0-3,8,10-11"
+*/
+bool parse_cpu_list(const char *list, vector<int> &cpus) {
+	const char *next = list;
+	while(*next != '\0' && *next != '\n') {
+		char *end;
+		long first = strtol(next, &end, 10);
+		if(end == next || first < 0) {
+			return false;
+		}
+		long last = first;
+		if(*end == '-') {
+			next = end + 1;
+			last = strtol(next, &end, 10);
+			if(end == next || last < first) {
+				return false;
+			}
+		}
+		for(long cpu = first; cpu <= last; ++cpu) {
+			cpus.push_back(cpu);
+		}
+		next = (*end == ',') ? end + 1 : end;
+	}
+	return true;
+}
+
+/*
+	NUMA node of every CPU in /sys/devices/system/node; empty without NUMA
+*/
+std::map<int, int> read_cpu_nodes() {
+	std::map<int, int> cpu_nodes;
+	DIR *dir = opendir("/sys/devices/system/node");
+	if(dir == NULL) {
+		return cpu_nodes;
+	}
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL) {
+		int node;
+		if(sscanf(entry->d_name, "node%d", &node) != 1) {
+			continue;
+		}
+		ifstream file((string("/sys/devices/system/node/") + entry->d_name + "/cpulist").c_str());
+		string list;
+		getline(file, list);
+		vector<int> cpus;
+		parse_cpu_list(list.c_str(), cpus);
+		for(int i = 0; i < cpus.size(); ++i) {
+			cpu_nodes[cpus[i]] = node;
+		}
+	}
+	closedir(dir);
+	return cpu_nodes;
+}
+
+/*
+	Fills affinity from -k. Runs in the master before the workers are forked.
+*/
+void affinity_init() {
+	if(global_args.affinity == "off") {
+		return;
+	}
+
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		log_error << "sched_getaffinity error: " << strerror(errno) << endl;
+		return;
+	}
+
+	std::map<int, int> cpu_nodes = read_cpu_nodes();
+
+	vector<int> requested;
+	if(global_args.affinity == "auto") {
+		vector<pair<int, int> > by_node;
+		for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if(CPU_ISSET(cpu, &allowed)) {
+				by_node.push_back(make_pair(cpu_nodes.count(cpu) ? cpu_nodes[cpu] : 0, cpu));
+			}
+		}
+		std::sort(by_node.begin(), by_node.end());
+		for(int i = 0; i < by_node.size(); ++i) {
+			requested.push_back(by_node[i].second);
+		}
+	} else if(!parse_cpu_list(global_args.affinity.c_str(), requested)) {
+		log_error << "Bad CPU list: " << global_args.affinity << endl;
+		return;
+	}
+
+	string list;
+	for(int i = 0; i < requested.size(); ++i) {
+		int cpu = requested[i];
+		if(cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+			log_warn << "CPU " << cpu << " is not available" << endl;
+			continue;
+		}
+		affinity.cpus.push_back(cpu);
+		affinity.nodes.push_back(cpu_nodes.count(cpu) ? cpu_nodes[cpu] : 0);
+		append_format(list, list.empty() ? "%d/%d" : " %d/%d", cpu, affinity.nodes.back());
+	}
+
+	log_info << "CPU affinity (cpu/node): " << list << endl;
+}
+
+/*
+	CPU of the worker at position, -1 when workers are not pinned
+*/
+int affinity_cpu(int position) {
+	if(affinity.cpus.empty() || position < 0) {
+		return -1;
+	}
+	return affinity.cpus[position % affinity.cpus.size()];
+}
+
+void affinity_apply(int position) {
+	int cpu = affinity_cpu(position);
+	if(cpu == -1) {
+		return;
+	}
+
+	int node = affinity.nodes[position % affinity.cpus.size()];
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(global_args.threads > 1) {
+		for(int i = 0; i < affinity.cpus.size(); ++i) {
+			if(affinity.nodes[i] == node) {
+				CPU_SET(affinity.cpus[i], &set);
+			}
+		}
+	} else {
+		CPU_SET(cpu, &set);
+	}
+
+	if(sched_setaffinity(0, sizeof(set), &set) == -1) {
+		log_error << "PID " << getpid() << ": sched_setaffinity error: " << strerror(errno) << endl;
+		return;
+	}
+	log_info << "PID " << getpid() << ": pinned to " << (global_args.threads > 1 ? "node of CPU " : "CPU ") << cpu << ", node " << node << endl;
+}
+
+/*
+	LISTEN SOCKET
+*/
+int create_listen_socket(bool reuseport) {
+	int listen_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	int flag = 1;
+	if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1) {
+		log_error << "Reuse addr error: " << errno << endl;
+		log_error << strerror(errno) << endl;
+	} else {
+		log_info << "Reuse addr: OK" << endl;
+	}
+
+	if(reuseport) {
+		if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) == -1) {
+			log_error << "Reuse port error: " << errno << endl;
+			log_error << strerror(errno) << endl;
+			exit(EXIT_FAILURE);
+		} else {
+			log_info << "Reuse port: OK" << endl;
+		}
+	}
+
+	log_info << "ip: " << global_args.host << endl;
+	log_info << "port: " << global_args.port << endl;
+
+	struct sockaddr_in SockAddr;
+
+	SockAddr.sin_family = AF_INET;
+	SockAddr.sin_port = htons(global_args.port);
+
+	if(global_args.host.compare("localhost") == 0) {
+		log_info << "localhost => 127.0.0.1" << endl;
+		SockAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	} else {
+		SockAddr.sin_addr.s_addr = inet_addr(global_args.host.c_str());
+	}
+
+	if(::bind(listen_socket, (struct sockaddr *)(&SockAddr), sizeof(SockAddr)) == -1) {
+		log_error << "Bind error: " << errno << endl;
+		log_error << strerror(errno) << endl;
+		exit(EXIT_FAILURE);
+	} else {
+		log_info << "Bind: OK" << endl;
+	}
+
+	set_nonblock(listen_socket);
+
+	if(listen(listen_socket, SOMAXCONN) == -1) {
+		log_error << "Listen error: " << errno << endl;
+		log_error << strerror(errno) << endl;
+		exit(EXIT_FAILURE);
+	} else {
+		log_info << "Listen: OK" << endl;
+	}
+
+	return listen_socket;
+}
+
+bool reuseport_supported() {
+	int probe = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int flag = 1;
+	bool supported = setsockopt(probe, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) == 0;
+	close(probe);
+	return supported;
+}
+
+/*
+	Whether an inherited descriptor is a listening socket on our port
+	that fits the listen mode
+*/
+bool listen_socket_usable(int fd) {
+	struct sockaddr_in address;
+	socklen_t address_size = sizeof(address);
+	int listening = 0;
+	int reuseport = 0;
+	socklen_t flag_size = sizeof(int);
+
+	if(getsockname(fd, (struct sockaddr *)&address, &address_size) == -1
+		|| address.sin_family != AF_INET || ntohs(address.sin_port) != global_args.port) {
+		return false;
+	}
+	if(getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &flag_size) == -1 || !listening) {
+		return false;
+	}
+	flag_size = sizeof(int);
+	getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, &flag_size);
+	return (reuseport != 0) == (global_args.mode == REUSEPORT);
+}
+
+/*
+	Connection steering (-s, needs -k): a connection goes to the worker
+	pinned to the CPU that received its packets, where the socket is warm
+	in cache.
+	cpu  - reuseport: SO_INCOMING_CPU on every listening socket makes the
+	       kernel prefer the socket of the worker on the receiving CPU
+	       (Linux 6.2+); fdpass: the master reads SO_INCOMING_CPU of a
+	       connection and hands it to the worker on that CPU
+	cbpf - reuseport: a classic BPF program attached to the group picks
+	       the socket by the receiving CPU (Linux 4.6+); fdpass: as cpu
+	Socket i of the group belongs to the worker at position i. Positions
+	j, j + n, j + 2n, ... share CPU affinity.cpus[j]; the program picks
+	one of them at random.
+*/
+struct sock_filter bpf_statement(unsigned short code, uint32_t k) {
+	struct sock_filter statement = BPF_STMT(code, k);
+	return statement;
+}
+
+struct sock_filter bpf_jump(unsigned short code, uint32_t k, unsigned char jump_true, unsigned char jump_false) {
+	struct sock_filter jump = BPF_JUMP(code, k, jump_true, jump_false);
+	return jump;
+}
+
+void steer_listen_sockets() {
+	if(global_args.steering == STEER_OFF || global_args.mode != REUSEPORT) {
+		return;
+	}
+	if(affinity.cpus.empty()) {
+		log_warn << "Connection steering needs pinned workers (-k)" << endl;
+		return;
+	}
+
+	int workers = master_vars.listen_sockets.size();
+
+	if(global_args.steering == STEER_INCOMING_CPU) {
+		for(int i = 0; i < workers; ++i) {
+			int cpu = affinity_cpu(i);
+			if(setsockopt(master_vars.listen_sockets[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+				log_error << "SO_INCOMING_CPU error: " << strerror(errno) << endl;
+				return;
+			}
+		}
+		log_info << "Steering: SO_INCOMING_CPU" << endl;
+		return;
+	}
+
+	int n = min((int)affinity.cpus.size(), workers);
+	vector<struct sock_filter> program;
+	program.push_back(bpf_statement(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU));
+	for(int j = 0; j < n; ++j) {
+		int sockets = (workers - j + n - 1) / n;
+		program.push_back(bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, affinity.cpus[j], 0, 5));
+		program.push_back(bpf_statement(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM));
+		program.push_back(bpf_statement(BPF_ALU | BPF_MOD | BPF_K, sockets));
+		program.push_back(bpf_statement(BPF_ALU | BPF_MUL | BPF_K, n));
+		program.push_back(bpf_statement(BPF_ALU | BPF_ADD | BPF_K, j));
+		program.push_back(bpf_statement(BPF_RET | BPF_A, 0));
+	}
+	// Received on a CPU without a worker: any socket
+	program.push_back(bpf_statement(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM));
+	program.push_back(bpf_statement(BPF_ALU | BPF_MOD | BPF_K, workers));
+	program.push_back(bpf_statement(BPF_RET | BPF_A, 0));
+
+	struct sock_fprog fprog;
+	fprog.len = program.size();
+	fprog.filter = &program[0];
+	if(setsockopt(master_vars.listen_sockets[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)) == -1) {
+		log_error << "SO_ATTACH_REUSEPORT_CBPF error: " << strerror(errno) << endl;
+		return;
+	}
+	log_info << "Steering: reuseport CBPF, " << program.size() << " instructions" << endl;
+}
+
+/*
+	Fills master_vars.listen_sockets: one socket in fdpass mode, one per
+	worker in reuseport mode (a restarted worker takes over the socket of
+	the one it replaces, together with its queue of pending connections).
+	After an upgrade the sockets of the old binary are taken over from
+	LISTEN_FDS_ENV, so no connection waiting in a queue is lost.
+*/
+void open_listen_sockets() {
+	int count = global_args.mode == REUSEPORT ? global_args.workers : 1;
+
+	const char *inherited = getenv(LISTEN_FDS_ENV);
+	if(inherited != NULL) {
+		for(const char *next = inherited; *next != '\0'; ) {
+			char *end;
+			int fd = strtol(next, &end, 10);
+			if(end == next) {
+				break;
+			}
+			if(master_vars.listen_sockets.size() < count && listen_socket_usable(fd)) {
+				log_info << "Listen socket " << fd << " inherited" << endl;
+				master_vars.listen_sockets.push_back(fd);
+			} else {
+				close(fd);
+			}
+			next = (*end == ',') ? end + 1 : end;
+		}
+		unsetenv(LISTEN_FDS_ENV);
+	}
+
+	while(master_vars.listen_sockets.size() < count) {
+		master_vars.listen_sockets.push_back(create_listen_socket(global_args.mode == REUSEPORT));
+	}
+
+	steer_listen_sockets();
+}
+
+/*
+	A position no running worker has, from 0 to global_args.workers - 1.
+	A worker that replaces another takes over its position, which decides
+	its listening socket in reuseport mode and its CPU with -k.
+*/
+int free_position() {
+	for(int i = 0; i < global_args.workers; ++i) {
+		if(std::find(master_vars.positions.begin(), master_vars.positions.end(), i) == master_vars.positions.end()) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/*
+	I/O BACKEND
+
+	The worker event loop waits for events through io_backend_t, which is
+	either epoll or io_uring (-i). io_uring is driven with raw syscalls:
+	every registration change becomes a queued SQE and all of them are
+	submitted by the same io_uring_enter() that waits for completions, so a
+	loop iteration costs one syscall however many connections change state.
+	Readiness uses one-shot IORING_OP_POLL_ADD, re-armed after the event is
+	handled, which keeps the level-triggered semantics of the epoll path.
+	The listening socket uses multishot accept, so accepted descriptors
+	arrive as completions with no accept() calls. EPOLLONESHOT works with
+	both: after one event the descriptor stays quiet until io_modify().
+
+	Connections the worker accepted itself (io_add_connection) go further:
+	instead of polling for EPOLLIN the ring receives into a buffer it picks
+	from a group provided up front (IORING_OP_PROVIDE_BUFFERS), so the bytes
+	come with the event (IO_RECEIVED) and go back to the group once copied
+	(io_release_buffer). When the group runs dry the next wait is a poll.
+	Connections from the master are polled: one handed back with a receive
+	in flight could lose the next request to it. File bodies go out as two
+	linked splices, file to pipe and pipe to socket (io_send_file), and
+	their result comes as an event with IO_FILE_SENT.
+
+	When io_uring is not available (old kernel, seccomp) the worker falls
+	back to epoll.
+*/
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(IORING_FEAT_EXT_ARG) && defined(IORING_ACCEPT_MULTISHOT)
+#define HAVE_IO_URING 1
+#endif
+
+#define IO_URING_ENTRIES 256
+#define IO_URING_BUFFERS 128            // provided receive buffers of BUFFER_SIZE per worker
+#define IO_URING_BUFFER_GROUP 0
+
+// Completions of POLL_REMOVE, ASYNC_CANCEL and PROVIDE_BUFFERS requests and
+// of the poll in a file send carry this bit and are skipped
+#define IO_USER_DATA_INTERNAL (1ULL << 63)
+// Accept completions carry this bit: one that arrives after the listener
+// was removed still holds a connection to serve
+#define IO_USER_DATA_ACCEPT (1ULL << 62)
+// Bits 60-61 tell which request of a descriptor completed
+#define IO_USER_DATA_OP_SHIFT 60
+#define IO_GENERATION_MASK 0x0fffffffU
+
+enum io_request_op {IO_OP_POLL, IO_OP_RECV, IO_OP_FILL, IO_OP_SEND};
+
+// Events beyond the epoll ones, never passed to the kernel
+#define IO_RECEIVED (1U << 26)      // with EPOLLIN: the bytes are in data
+#define IO_FILE_SENT (1U << 25)     // with EPOLLOUT: a file send completed
+
+struct io_event_t {
+	int fd;
+	uint32_t events;   // EPOLLIN, EPOLLOUT, EPOLLHUP, EPOLLERR, IO_RECEIVED, IO_FILE_SENT
+	int accepted;      // a connection accepted on the listening socket fd, -1 if none
+	const char *data;  // IO_RECEIVED: the bytes, in the provided buffer number buffer
+	int buffer;
+	size_t size;       // IO_RECEIVED: bytes received; IO_FILE_SENT: bytes moved into the pipe
+	size_t sent;       // IO_FILE_SENT: bytes moved from the pipe to the socket
+};
+
+#ifdef HAVE_IO_URING
+struct io_fd_state_t {
+	uint32_t generation;    // stale completions carry an older one
+	uint32_t events;
+	bool registered;
+	bool armed;             // a poll, accept, receive or file send is in flight
+	bool accepting;         // multishot accept instead of poll
+	bool receiving;         // receive into a provided buffer instead of polling for EPOLLIN
+	bool poll_once;         // no buffer was left: poll for the next EPOLLIN
+	uint8_t op;             // io_request_op of the request in flight
+	int filled;             // IO_OP_FILL result of the file send in flight
+};
+
+struct io_uring_t {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned queued;                // SQEs not submitted yet
+	vector<io_fd_state_t> fds;
+	vector<int> rearm;              // fired one-shot requests to re-arm before waiting
+	vector<char> buffers;           // IO_URING_BUFFERS provided buffers
+	std::map<int, vector<int> > sending;  // sockets with a file send in flight: descriptors to close after it
+};
+#endif
+
+struct io_backend_t {
+	io_backend_kind kind;
+	int epoll;
+#ifdef HAVE_IO_URING
+	io_uring_t uring;
+#endif
+};
+
+#ifdef HAVE_IO_URING
+int io_uring_setup_ring(io_uring_t &ring) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring.fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+	if(ring.fd == -1) {
+		log_warn << "io_uring_setup error: " << strerror(errno) << endl;
+		return -1;
+	}
+
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+		log_warn << "io_uring is too old: features " << params.features << endl;
+		close(ring.fd);
+		return -1;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = max(sq_size, cq_size);
+
+	char *rings = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(rings == MAP_FAILED || sqes == MAP_FAILED) {
+		log_warn << "io_uring mmap error: " << strerror(errno) << endl;
+		close(ring.fd);
+		return -1;
+	}
+
+	ring.sq_head = (unsigned *)(rings + params.sq_off.head);
+	ring.sq_tail = (unsigned *)(rings + params.sq_off.tail);
+	ring.sq_mask = *(unsigned *)(rings + params.sq_off.ring_mask);
+	ring.sq_entries = params.sq_entries;
+	ring.sqes = (struct io_uring_sqe *)sqes;
+	ring.cq_head = (unsigned *)(rings + params.cq_off.head);
+	ring.cq_tail = (unsigned *)(rings + params.cq_off.tail);
+	ring.cq_mask = *(unsigned *)(rings + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+	ring.queued = 0;
+
+	// SQE i always sits in slot i
+	unsigned *sq_array = (unsigned *)(rings + params.sq_off.array);
+	for(unsigned i = 0; i < params.sq_entries; ++i) {
+		sq_array[i] = i;
+	}
+
+	return 0;
+}
+
+int io_uring_enter(io_uring_t &ring, unsigned wait_count, int timeout_ms) {
+	struct __kernel_timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&timeout;
+
+	unsigned flags = IORING_ENTER_EXT_ARG | (wait_count > 0 ? IORING_ENTER_GETEVENTS : 0);
+	int submitted = syscall(__NR_io_uring_enter, ring.fd, ring.queued, wait_count, flags, &arg, sizeof(arg));
+	if(submitted > 0) {
+		ring.queued -= min((unsigned)submitted, ring.queued);
+	}
+	return submitted;
+}
+
+/*
+	Makes room for count SQEs, so that linked ones are submitted together
+*/
+void io_uring_reserve(io_uring_t &ring, unsigned count) {
+	if(*ring.sq_tail + count - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) > ring.sq_entries) {
+		// Full: submit what is queued without waiting
+		io_uring_enter(ring, 0, 0);
+	}
+}
+
+struct io_uring_sqe *io_uring_next_sqe(io_uring_t &ring) {
+	io_uring_reserve(ring, 1);
+	unsigned tail = *ring.sq_tail;
+	struct io_uring_sqe *sqe = &ring.sqes[tail & ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring.queued;
+	return sqe;
+}
+
+io_fd_state_t &io_uring_fd_state(io_uring_t &ring, int fd) {
+	if(fd >= ring.fds.size()) {
+		io_fd_state_t unused = {0, 0, false, false, false, false, false, IO_OP_POLL, 0};
+		ring.fds.resize(fd + 1024, unused);
+	}
+	return ring.fds[fd];
+}
+
+uint64_t io_uring_user_data(int fd, const io_fd_state_t &state, int op) {
+	uint64_t user_data = ((uint64_t)(state.generation & IO_GENERATION_MASK) << 32) | ((uint64_t)op << IO_USER_DATA_OP_SHIFT) | (uint32_t)fd;
+	return state.accepting ? user_data | IO_USER_DATA_ACCEPT : user_data;
+}
+
+/*
+	Hands count buffers from number first on to the kernel
+*/
+void io_uring_provide_buffers(io_uring_t &ring, int first, int count) {
+	struct io_uring_sqe *sqe = io_uring_next_sqe(ring);
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (uint64_t)(uintptr_t)&ring.buffers[(size_t)first * BUFFER_SIZE];
+	sqe->len = BUFFER_SIZE;
+	sqe->off = first;
+	sqe->buf_group = IO_URING_BUFFER_GROUP;
+	sqe->user_data = IO_USER_DATA_INTERNAL;
+}
+
+void io_uring_arm(io_uring_t &ring, int fd) {
+	io_fd_state_t &state = ring.fds[fd];
+	struct io_uring_sqe *sqe = io_uring_next_sqe(ring);
+	sqe->fd = fd;
+	if(state.accepting) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		state.op = IO_OP_POLL;
+	} else if(state.receiving && !state.poll_once && (state.events & (EPOLLIN | EPOLLOUT)) == EPOLLIN) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = IO_URING_BUFFER_GROUP;
+		sqe->len = BUFFER_SIZE;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		state.op = IO_OP_RECV;
+	} else {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = state.events & ~EPOLLONESHOT;
+		state.op = IO_OP_POLL;
+	}
+	sqe->user_data = io_uring_user_data(fd, state, state.op);
+	state.poll_once = false;
+	state.armed = true;
+}
+
+void io_uring_disarm(io_uring_t &ring, int fd) {
+	io_fd_state_t &state = ring.fds[fd];
+	if(state.armed) {
+		struct io_uring_sqe *sqe = io_uring_next_sqe(ring);
+		sqe->opcode = (state.accepting || state.op != IO_OP_POLL) ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = io_uring_user_data(fd, state, state.op);
+		sqe->user_data = IO_USER_DATA_INTERNAL;
+		state.armed = false;
+	}
+	++state.generation;
+}
+
+void io_uring_add(io_uring_t &ring, int fd, uint32_t events, bool accepting, bool receiving) {
+	io_fd_state_t &state = io_uring_fd_state(ring, fd);
+	++state.generation;
+	state.events = events;
+	state.registered = true;
+	state.accepting = accepting;
+	state.receiving = receiving;
+	io_uring_arm(ring, fd);
+}
+
+/*
+	The file send on fd has completed: closes what io_close() left open
+*/
+void io_uring_sent(io_uring_t &ring, int fd) {
+	std::map<int, vector<int> >::iterator it = ring.sending.find(fd);
+	if(it == ring.sending.end()) {
+		return;
+	}
+	for(int i = 0; i < it->second.size(); ++i) {
+		close(it->second[i]);
+	}
+	ring.sending.erase(it);
+}
+#endif
+
+/*
+	Sets up the backend of kind, or epoll when that fails
+*/
+void io_init(io_backend_t &io, io_backend_kind kind) {
+	io.kind = IO_EPOLL;
+	io.epoll = -1;
+#ifdef HAVE_IO_URING
+	if(kind == IO_URING) {
+		if(io_uring_setup_ring(io.uring) == 0) {
+			io.kind = IO_URING;
+			io.uring.buffers.resize((size_t)IO_URING_BUFFERS * BUFFER_SIZE);
+			io_uring_provide_buffers(io.uring, 0, IO_URING_BUFFERS);
+			return;
+		}
+		log_warn << "io_uring is not available, falling back to epoll" << endl;
+	}
+#else
+	if(kind == IO_URING) {
+		log_warn << "Built without io_uring, falling back to epoll" << endl;
+	}
+#endif
+	io.epoll = epoll_create1(0);
+}
+
+void io_add(io_backend_t &io, int fd, uint32_t events) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_add(io.uring, fd, events, false, false);
+		return;
+	}
+#endif
+	struct epoll_event event;
+	event.data.fd = fd;
+	event.events = events;
+	epoll_ctl(io.epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+/*
+	Watches a connection the worker keeps to itself. With io_uring EPOLLIN
+	comes with the received bytes (IO_RECEIVED).
+*/
+void io_add_connection(io_backend_t &io, int fd, uint32_t events) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_add(io.uring, fd, events, false, true);
+		return;
+	}
+#endif
+	io_add(io, fd, events);
+}
+
+void io_modify(io_backend_t &io, int fd, uint32_t events) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_disarm(io.uring, fd);
+		io.uring.fds[fd].events = events;
+		io_uring_arm(io.uring, fd);
+		return;
+	}
+#endif
+	struct epoll_event event;
+	event.data.fd = fd;
+	event.events = events;
+	epoll_ctl(io.epoll, EPOLL_CTL_MOD, fd, &event);
+}
+
+void io_remove(io_backend_t &io, int fd) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_disarm(io.uring, fd);
+		io.uring.fds[fd].registered = false;
+		return;
+	}
+#endif
+	epoll_ctl(io.epoll, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/*
+	Gives a buffer of an IO_RECEIVED event back once its bytes are copied
+*/
+void io_release_buffer(io_backend_t &io, int buffer) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_provide_buffers(io.uring, buffer, 1);
+	}
+#endif
+}
+
+/*
+	io_uring only: sends up to fill bytes of file_fd from offset to the
+	socket fd, through the pipe with two linked splices; or, when pending
+	bytes are still in the pipe, those alone. A linked poll holds the
+	second splice until the socket is writable: on a full socket it would
+	fail at once. Replaces the registration of fd until the completion, an
+	event with IO_FILE_SENT; after it fd is watched for events. The kernel
+	looks the descriptors up when each request starts, so until then they
+	must be closed with io_close(); shutdown() wakes the poll.
+*/
+void io_send_file(io_backend_t &io, int fd, int file_fd, off_t offset, size_t fill, const int *pipe_fds, size_t pending, uint32_t events) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_t &ring = io.uring;
+		io_uring_disarm(ring, fd);
+		io_fd_state_t &state = ring.fds[fd];
+		state.events = events;
+		state.filled = 0;
+		ring.sending[fd];
+		io_uring_reserve(ring, 3);
+
+		size_t length = pending;
+		if(pending == 0) {
+			struct io_uring_sqe *sqe = io_uring_next_sqe(ring);
+			sqe->opcode = IORING_OP_SPLICE;
+			sqe->splice_fd_in = file_fd;
+			sqe->splice_off_in = offset;
+			sqe->fd = pipe_fds[1];
+			sqe->off = (uint64_t)-1;
+			sqe->len = fill;
+			sqe->splice_flags = SPLICE_F_MOVE;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = io_uring_user_data(fd, state, IO_OP_FILL);
+			length = fill;
+		}
+
+		struct io_uring_sqe *sqe = io_uring_next_sqe(ring);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = EPOLLOUT;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = IO_USER_DATA_INTERNAL;
+
+		sqe = io_uring_next_sqe(ring);
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->splice_fd_in = pipe_fds[0];
+		sqe->splice_off_in = (uint64_t)-1;
+		sqe->fd = fd;
+		sqe->off = (uint64_t)-1;
+		sqe->len = length;
+		sqe->splice_flags = SPLICE_F_MOVE;
+		sqe->user_data = io_uring_user_data(fd, state, IO_OP_SEND);
+		state.op = IO_OP_SEND;
+		state.armed = true;
+		return;
+	}
+#endif
+	io_modify(io, fd, events);
+}
+
+/*
+	Closes other, a descriptor of the connection on fd; with a file send in
+	flight on fd, once it completes (see io_send_file)
+*/
+void io_close(io_backend_t &io, int fd, int other) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		std::map<int, vector<int> >::iterator it = io.uring.sending.find(fd);
+		if(it != io.uring.sending.end()) {
+			it->second.push_back(other);
+			return;
+		}
+	}
+#endif
+	close(other);
+}
+
+/*
+	Watches a listening socket. With io_uring accepted connections come as
+	events with accepted set; with epoll the caller accepts on EPOLLIN.
+*/
+void io_add_listener(io_backend_t &io, int fd) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_add(io.uring, fd, EPOLLIN, true, false);
+		return;
+	}
+#endif
+	io_add(io, fd, EPOLLIN);
+}
+
+#ifdef HAVE_IO_URING
+/*
+	Turns a receive completion into an event. Returns false when there is
+	none to report.
+*/
+bool io_uring_received(io_uring_t &ring, int fd, const struct io_uring_cqe &cqe, io_event_t &event) {
+	io_fd_state_t &state = ring.fds[fd];
+	int buffer = (cqe.flags & IORING_CQE_F_BUFFER) ? (int)(cqe.flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+	if(cqe.res > 0 && buffer != -1) {
+		event.events = EPOLLIN | IO_RECEIVED;
+		event.data = &ring.buffers[(size_t)buffer * BUFFER_SIZE];
+		event.buffer = buffer;
+		event.size = cqe.res;
+		return true;
+	}
+	if(buffer != -1) {
+		io_uring_provide_buffers(ring, buffer, 1);
+	}
+	if(cqe.res == -ENOBUFS || cqe.res == -EAGAIN || cqe.res == -EINTR) {
+		state.poll_once = cqe.res == -ENOBUFS;
+		ring.rearm.push_back(fd);
+		return false;
+	}
+	event.events = cqe.res == 0 ? EPOLLHUP : EPOLLERR;
+	return true;
+}
+
+/*
+	Turns the completion of a file send into an event
+*/
+void io_uring_file_sent(io_uring_t &ring, int fd, const struct io_uring_cqe &cqe, io_event_t &event) {
+	io_fd_state_t &state = ring.fds[fd];
+	event.events = EPOLLOUT | IO_FILE_SENT;
+	event.size = state.filled > 0 ? state.filled : 0;
+	event.sent = cqe.res > 0 ? cqe.res : 0;
+	if(state.filled == -EINVAL) {
+		// Like sendfile(): this file can not be spliced, go without the ring
+		log_warn << "io_uring splice is not supported, falling back to sendfile" << endl;
+		ring_file_sends = false;
+	} else if(state.filled < 0 || (cqe.res < 0 && cqe.res != -ECANCELED && cqe.res != -EAGAIN)
+		|| (cqe.res == -ECANCELED && state.filled == 0)) {
+		// A short fill breaks the link and cancels the send, which is fine
+		// unless nothing was filled: the file was truncated under us
+		log_debug << "FD " << fd << ": io_uring file send error: " << strerror(state.filled < 0 ? -state.filled : -cqe.res) << endl;
+		event.events = EPOLLERR;
+	}
+}
+#endif
+
+/*
+	Waits up to timeout_ms for events, like epoll_wait()
+*/
+int io_wait(io_backend_t &io, io_event_t *events, int max_events, int timeout_ms) {
+#ifdef HAVE_IO_URING
+	if(io.kind == IO_URING) {
+		io_uring_t &ring = io.uring;
+
+		for(int i = 0; i < ring.rearm.size(); ++i) {
+			io_fd_state_t &state = ring.fds[ring.rearm[i]];
+			if(state.registered && !state.armed) {
+				io_uring_arm(ring, ring.rearm[i]);
+			}
+		}
+		ring.rearm.clear();
+
+		unsigned head = *ring.cq_head;
+		if(head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			int result = io_uring_enter(ring, 1, timeout_ms);
+			if(result < 0 && errno != ETIME) {
+				return -1;
+			}
+		} else if(ring.queued > 0) {
+			io_uring_enter(ring, 0, 0);
+		}
+
+		int count = 0;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != tail && count < max_events; ++head) {
+			struct io_uring_cqe &cqe = ring.cqes[head & ring.cq_mask];
+			if(cqe.user_data & IO_USER_DATA_INTERNAL) {
+				continue;
+			}
+			int fd = (uint32_t)cqe.user_data;
+			int op = (cqe.user_data >> IO_USER_DATA_OP_SHIFT) & 3;
+			io_fd_state_t &state = ring.fds[fd];
+			if(op == IO_OP_SEND) {
+				io_uring_sent(ring, fd);
+			}
+			if(((cqe.user_data >> 32) & IO_GENERATION_MASK) != (state.generation & IO_GENERATION_MASK)) {
+				if((cqe.user_data & IO_USER_DATA_ACCEPT) && cqe.res >= 0) {
+					events[count].fd = fd;
+					events[count].events = EPOLLIN;
+					events[count].accepted = cqe.res;
+					++count;
+				} else if(cqe.flags & IORING_CQE_F_BUFFER) {
+					io_uring_provide_buffers(ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT, 1);
+				}
+				continue;
+			}
+
+			if(state.accepting) {
+				if(!(cqe.flags & IORING_CQE_F_MORE)) {
+					state.armed = false;
+					ring.rearm.push_back(fd);
+				}
+				if(cqe.res == -EINVAL) {
+					// No multishot accept in this kernel: poll and accept()
+					state.accepting = false;
+					continue;
+				}
+				if(cqe.res >= 0) {
+					events[count].fd = fd;
+					events[count].events = EPOLLIN;
+					events[count].accepted = cqe.res;
+					++count;
+				}
+				continue;
+			}
+
+			if(op == IO_OP_FILL) {
+				state.filled = cqe.res;
+				continue;
+			}
+
+			state.armed = false;
+			events[count].fd = fd;
+			events[count].accepted = -1;
+			if(op == IO_OP_RECV) {
+				if(!io_uring_received(ring, fd, cqe, events[count])) {
+					continue;
+				}
+			} else if(op == IO_OP_SEND) {
+				io_uring_file_sent(ring, fd, cqe, events[count]);
+			} else if(cqe.res < 0) {
+				// cancelled or failed: poll again
+				ring.rearm.push_back(fd);
+				continue;
+			} else {
+				events[count].events = cqe.res;
+			}
+			++count;
+			if(!(state.events & EPOLLONESHOT)) {
+				ring.rearm.push_back(fd);
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		return count;
+	}
+#endif
+	struct epoll_event epoll_events[MAX_EVENTS];
+	int count = epoll_wait(io.epoll, epoll_events, min(max_events, MAX_EVENTS), timeout_ms);
+	for(int i = 0; i < count; ++i) {
+		events[i].fd = epoll_events[i].data.fd;
+		events[i].events = epoll_events[i].events;
+		events[i].accepted = -1;
+	}
+	return count;
+}
+
+/*
+	WORKER
+
+	Every worker runs its own non-blocking event loop over many connections
+	(see I/O BACKEND).
+	In reuseport mode it owns a listening socket bound to the same host:port
+	and accepts by itself. In fdpass mode it receives readable connections
+	from the master through the socketpair and owns them until it has
+	answered everything buffered; then kept-alive ones go back to the master
+	in one message per loop iteration (worker_vars.returns). EOF on the
+	socketpair means the master has gone and the worker exits.
+
+	SIGTERM makes a worker drain: it stops accepting, answers what it has
+	with keep-alive off, closes connections idle between requests and exits
+	when none is left, or at the deadline (-g) whatever is left.
+*/
+struct worker_vars_t {
+	int socket;                 // socketpair end to the master
+	handoff_batch_t returns;    // connections to pass back to the master
+	uint32_t oneshot;           // EPOLLONESHOT when request threads serve connections
+	time_t drain_deadline;      // 0 when not draining
+} worker_vars;
+
+/*
+	What the event loop does with a connection after serving an event.
+	CONN_SEND_FILE: start an io_uring file send (see io_send_file).
+*/
+enum conn_action {CONN_READ, CONN_WRITE, CONN_CLOSE, CONN_RETURN, CONN_SEND_FILE};
+
+void send_returns() {
+	if(worker_vars.returns.count == 0) {
+		return;
+	}
+	sock_fds_write(worker_vars.socket, worker_vars.returns.messages, worker_vars.returns.fds, worker_vars.returns.count);
+	// On failure the connections are lost with their descriptors
+	for(int i = 0; i < worker_vars.returns.count; ++i) {
+		close(worker_vars.returns.fds[i]);
+	}
+	worker_vars.returns.count = 0;
+}
+
+void return_connection(connection_t &conn) {
+	handoff_batch_t &returns = worker_vars.returns;
+	channel_message_t &message = returns.messages[returns.count];
+	memset(&message, 0, sizeof(message));
+	message.type = HANDOFF_RETURN;
+	message.requests = conn.requests;
+	message.peer = conn.access.peer;
+	returns.fds[returns.count++] = conn.fd;
+	if(returns.count == HANDOFF_BATCH_MAX) {
+		send_returns();
+	}
+}
+
+void close_connection(std::map<int, connection_t> &connections, io_backend_t &io, int fd, bool terminate) {
+	log_debug << "FD " << fd << (terminate ? " close" : " handed back") << endl;
+
+	// io_close(): a file send in flight may still use them
+	connection_t &conn = connections[fd];
+	if(conn.file_fd != -1) {
+		io_close(io, fd, conn.file_fd);
+	}
+	if(conn.pipe_fds[0] != -1) {
+		io_close(io, fd, conn.pipe_fds[0]);
+		io_close(io, fd, conn.pipe_fds[1]);
+	}
+
+	if(!conn.owned) {
+		// Reported to the master's dispatcher (see choose_worker)
+		METRICS_ADD(completed, 1);
+	}
+
+	io_remove(io, fd);
+	if(terminate) {
+		shutdown(fd, SHUT_RDWR);
+		io_close(io, fd, fd);
+	} else if(!conn.owned) {
+		return_connection(conn);
+	} else {
+		io_close(io, fd, fd);
+	}
+	connections.erase(fd);
+	METRICS_ADD(active_connections, -1);
+}
+
+/*
+	Closes connections idle (or stalled) for longer than the keep-alive timeout
+*/
+void close_idle_connections(std::map<int, connection_t> &connections, io_backend_t &io) {
+	time_t now = time(NULL);
+	vector<int> idle;
+	for(std::map<int, connection_t>::iterator it = connections.begin(); it != connections.end(); ++it) {
+		if(!it->second.busy && now - it->second.last_active >= global_args.keep_alive_timeout) {
+			idle.push_back(it->first);
+		}
+	}
+	for(int i = 0; i < idle.size(); ++i) {
+		log_debug << "FD " << idle[i] << ": keep-alive timeout" << endl;
+		close_connection(connections, io, idle[i], true);
+	}
+}
+
+/*
+	While draining: closes connections idle between requests (a new one
+	still gets its first request answered), and after the deadline all
+	that no request thread holds. Returns true when none is left.
+*/
+bool drain_connections(std::map<int, connection_t> &connections, io_backend_t &io) {
+	bool expired = time(NULL) >= worker_vars.drain_deadline;
+	vector<int> done;
+	for(std::map<int, connection_t>::iterator it = connections.begin(); it != connections.end(); ++it) {
+		connection_t &conn = it->second;
+		if(conn.busy) {
+			continue;
+		}
+		if(expired || (conn.requests > 0 && conn.input.empty() && !conn.want_write)) {
+			done.push_back(it->first);
+		}
+	}
+	for(int i = 0; i < done.size(); ++i) {
+		close_connection(connections, io, done[i], true);
+	}
+	return connections.empty();
+}
+
+/*
+	Accounts the request that has just been written (or failed)
+*/
+void finish_request_record(connection_t &conn) {
+	finish_access_record(conn.access, conn.sent);
+	access_record_start(conn.access, conn.access.peer, 0, 0);
+}
+
+/*
+	Writes the pending response. Returns CONN_READ when it is complete and
+	the connection waits for the next request; CONN_WRITE when the write
+	has to be resumed on EPOLLOUT; CONN_SEND_FILE when the event loop
+	sends the file on.
+*/
+conn_action finish_response(connection_t &conn) {
+	switch(flush_output(conn)) {
+		case IO_AGAIN: {
+			conn.last_active = time(NULL);
+			return CONN_WRITE;
+		}
+		case IO_RING: {
+			conn.last_active = time(NULL);
+			return CONN_SEND_FILE;
+		}
+		case IO_ERROR: {
+			for(int i = 0; i < conn.queued.size(); ++i) {
+				finish_access_record(conn.queued[i].access, i == 0 ? conn.queued_offset : 0);
+			}
+			conn.queued.clear();
+			finish_request_record(conn);
+			return CONN_CLOSE;
+		}
+		case IO_DONE: {
+			finish_request_record(conn);
+			break;
+		}
+	}
+
+	conn.output.clear();
+	conn.output_offset = 0;
+	conn.cached.reset();
+	conn.body = NULL;
+	conn.body_end = 0;
+	conn.body_offset = 0;
+	conn.sent = 0;
+
+	if(!conn.keep_alive) {
+		return CONN_CLOSE;
+	}
+
+	if(!conn.owned && conn.input.empty()) {
+		return CONN_RETURN;
+	}
+
+	conn.last_active = time(NULL);
+	return CONN_READ;
+}
+
+/*
+	Moves the current response, which needs nothing but memory, behind the
+	queued ones
+*/
+void queue_response(connection_t &conn) {
+	conn.queued.push_back(queued_response_t());
+	queued_response_t &response = conn.queued.back();
+	response.header.swap(conn.output);
+	response.cached.swap(conn.cached);
+	response.body = conn.body + conn.body_offset;
+	response.body_size = conn.body_end - conn.body_offset;
+	response.access = conn.access;
+
+	conn.body = NULL;
+	conn.body_offset = 0;
+	conn.body_end = 0;
+	access_record_start(conn.access, conn.access.peer, 0, 0);
+}
+
+/*
+	Takes the last queued response back as the current one
+*/
+void unqueue_response(connection_t &conn) {
+	queued_response_t &response = conn.queued.back();
+	conn.output.swap(response.header);
+	conn.output_offset = 0;
+	conn.cached.swap(response.cached);
+	conn.body = response.body;
+	conn.body_offset = 0;
+	conn.body_end = response.body_size;
+	conn.access = response.access;
+	conn.keep_alive = true;
+	conn.queued.pop_back();
+}
+
+/*
+	Serves every complete request already buffered on the connection. The
+	responses to pipelined requests are gathered and written together: while
+	more input is buffered, a response without a file goes to conn.queued,
+	up to PIPELINE_BATCH_MAX of them.
+*/
+conn_action process_input(connection_t &conn) {
+	while(1) {
+		if(http_request_handler(conn) != IO_DONE) {
+			if(conn.queued.empty()) {
+				return CONN_READ;
+			}
+			// The next request is incomplete: send what is answered
+			unqueue_response(conn);
+		} else if(conn.keep_alive && !conn.input.empty() && conn.file_fd == -1 && conn.parts.empty()
+			&& conn.queued.size() < PIPELINE_BATCH_MAX - 1) {
+			queue_response(conn);
+			continue;
+		}
+
+		conn_action action = finish_response(conn);
+		if(action != CONN_READ) {
+			return action;
+		}
+	}
+}
+
+conn_action handle_writable(connection_t &conn) {
+	conn_action action = finish_response(conn);
+	if(action == CONN_READ) {
+		return process_input(conn);
+	}
+	return action;
+}
+
+/*
+	received: the backend has already appended the bytes to conn.input
+*/
+conn_action handle_readable(connection_t &conn, bool received) {
+	switch(received ? IO_DONE : read_request(conn)) {
+		case IO_AGAIN: {
+			if(!conn.owned && conn.input.empty() && conn.keep_alive_allowed) {
+				// Nothing to read after all: back to the master. A connection
+				// that may not be kept alive waits here for its last request.
+				return CONN_RETURN;
+			}
+			return CONN_READ;
+		}
+		case IO_RING:       // only writes are handed to the ring
+		case IO_ERROR: {
+			return CONN_CLOSE;
+		}
+		case IO_DONE: {
+			return process_input(conn);
+		}
+	}
+	return CONN_CLOSE;
+}
+
+/*
+	Serves one readiness event. Touches nothing but the connection, so it
+	runs on a request thread as well as on the event loop thread.
+*/
+conn_action handle_event(connection_t &conn, uint32_t events) {
+	if(events & (EPOLLHUP | EPOLLERR)) {
+		log_debug << "FD " << conn.fd << ": EPOLLHUP/EPOLLERR" << endl;
+		return CONN_CLOSE;
+	}
+	if(events & EPOLLOUT) {
+		return handle_writable(conn);
+	}
+	if(events & EPOLLIN) {
+		return handle_readable(conn, events & IO_RECEIVED);
+	}
+	return conn.want_write ? CONN_WRITE : CONN_READ;
+}
+
+/*
+	Carries out the action on the event loop thread. One-shot registrations
+	are re-armed every time; otherwise the backend is only told about a
+	change of direction.
+*/
+void apply_action(std::map<int, connection_t> &connections, io_backend_t &io, connection_t &conn, conn_action action) {
+	switch(action) {
+		case CONN_READ:
+		case CONN_WRITE: {
+			bool want_write = action == CONN_WRITE;
+			if(want_write != conn.want_write || worker_vars.oneshot) {
+				io_modify(io, conn.fd, (want_write ? EPOLLOUT : EPOLLIN) | worker_vars.oneshot);
+				conn.want_write = want_write;
 			}
-			*fd = *((int *)CMSG_DATA(cmsg));
+			break;
+		}
+		case CONN_CLOSE: {
+			close_connection(connections, io, conn.fd, true);
+			break;
+		}
+		case CONN_RETURN: {
+			close_connection(connections, io, conn.fd, false);
+			break;
+		}
+		case CONN_SEND_FILE: {
+			size_t fill = min((size_t)(conn.file_end - conn.file_offset), min((size_t)SEND_CHUNK_SIZE, conn.pipe_size));
+			io_send_file(io, conn.fd, conn.file_fd, conn.file_offset, fill, conn.pipe_fds, conn.pipe_pending, EPOLLOUT | worker_vars.oneshot);
+			conn.want_write = true;
+			break;
+		}
+	}
+}
+
+/*
+	WORK POOL
+
+	With -j N a worker runs N request threads next to its event loop. The
+	event loop keeps the backend and the connection map to itself: it pops
+	ready connections onto the deques of the request threads (by fd, so a
+	connection tends to stay on one thread and in one cache) and registers
+	them with EPOLLONESHOT, so a connection being served raises no events.
+	A thread takes the oldest item of its own deque; when that is empty it
+	steals the newest item of another one, so a slow handler on one thread
+	does not hold up the connections queued behind it. Results go back
+	through pool->done, and the eventfd pool->wakeup wakes the event loop
+	to apply them (see apply_action).
+*/
+struct work_item_t {
+	connection_t *conn;
+	uint32_t events;
+};
+
+struct work_done_t {
+	connection_t *conn;
+	conn_action action;
+};
+
+struct work_deque_t {
+	std::mutex lock;
+	std::deque<work_item_t> items;
+};
+
+struct work_pool_t {
+	vector<work_deque_t *> deques;     // one per request thread
+	std::atomic<int> queued;           // items in all deques, changed under their locks
+	std::mutex idle_lock;
+	std::condition_variable idle;
+	int sleeping;                      // threads waiting on idle, guarded by idle_lock
+	int pushed;                        // items queued since the last wake, event loop only
+	std::mutex done_lock;
+	vector<work_done_t> done;
+	int wakeup;                        // eventfd
+};
+
+// NULL when connections are served on the event loop thread. Never freed:
+// the threads run until the process exits.
+work_pool_t *work_pool = NULL;
+
+bool work_pool_take(int index, work_item_t &item) {
+	work_pool_t &pool = *work_pool;
+	int threads = pool.deques.size();
+	for(int i = 0; i < threads; ++i) {
+		work_deque_t &deque = *pool.deques[(index + i) % threads];
+		std::lock_guard<std::mutex> lock(deque.lock);
+		if(deque.items.empty()) {
+			continue;
+		}
+		if(i == 0) {
+			item = deque.items.front();
+			deque.items.pop_front();
 		} else {
-			log << "cmsg->cmsg_len = " << cmsg->cmsg_len << endl;
-			log << "CMSG_LEN(sizeof(int)) = " << CMSG_LEN(sizeof(int)) << endl; 
-			*fd = -1;
+			item = deque.items.back();
+			deque.items.pop_back();
+		}
+		pool.queued.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+void work_pool_finish(connection_t *conn, conn_action action) {
+	work_pool_t &pool = *work_pool;
+	bool first;
+	{
+		std::lock_guard<std::mutex> lock(pool.done_lock);
+		first = pool.done.empty();
+		work_done_t done = {conn, action};
+		pool.done.push_back(done);
+	}
+	if(first) {
+		uint64_t one = 1;
+		ssize_t written = write(pool.wakeup, &one, sizeof(one));
+		(void)written;
+	}
+}
+
+void work_thread(int index) {
+	work_pool_t &pool = *work_pool;
+	work_item_t item;
+	while(1) {
+		if(!work_pool_take(index, item)) {
+			std::unique_lock<std::mutex> lock(pool.idle_lock);
+			++pool.sleeping;
+			while(pool.queued.load(std::memory_order_relaxed) == 0) {
+				pool.idle.wait(lock);
+			}
+			--pool.sleeping;
+			continue;
+		}
+		work_pool_finish(item.conn, handle_event(*item.conn, item.events));
+	}
+}
+
+/*
+	Starts the request threads. Runs in the worker after fork(): threads
+	do not survive it.
+*/
+void work_pool_start(io_backend_t &io, int threads) {
+	work_pool = new work_pool_t();
+	work_pool->queued = 0;
+	work_pool->sleeping = 0;
+	work_pool->pushed = 0;
+	work_pool->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	io_add(io, work_pool->wakeup, EPOLLIN);
+
+	for(int i = 0; i < threads; ++i) {
+		work_pool->deques.push_back(new work_deque_t());
+	}
+	for(int i = 0; i < threads; ++i) {
+		std::thread(work_thread, i).detach();
+	}
+	worker_vars.oneshot = EPOLLONESHOT;
+}
+
+void work_pool_push(connection_t &conn, uint32_t events) {
+	work_pool_t &pool = *work_pool;
+	work_deque_t &deque = *pool.deques[conn.fd % pool.deques.size()];
+	work_item_t item = {&conn, events};
+	{
+		std::lock_guard<std::mutex> lock(deque.lock);
+		deque.items.push_back(item);
+		pool.queued.fetch_add(1, std::memory_order_relaxed);
+	}
+	++pool.pushed;
+}
+
+/*
+	Wakes as many sleeping threads as items were queued by this loop iteration
+*/
+void work_pool_wake() {
+	work_pool_t &pool = *work_pool;
+	if(pool.pushed == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(pool.idle_lock);
+	if(pool.pushed >= pool.sleeping) {
+		pool.idle.notify_all();
+	} else {
+		for(int i = 0; i < pool.pushed; ++i) {
+			pool.idle.notify_one();
 		}
+	}
+	pool.pushed = 0;
+}
+
+/*
+	Applies the results the request threads have reported
+*/
+void work_pool_complete(std::map<int, connection_t> &connections, io_backend_t &io) {
+	work_pool_t &pool = *work_pool;
+	uint64_t count;
+	ssize_t result = read(pool.wakeup, &count, sizeof(count));
+	(void)result;
+
+	vector<work_done_t> done;
+	{
+		std::lock_guard<std::mutex> lock(pool.done_lock);
+		done.swap(pool.done);
+	}
+	for(int i = 0; i < done.size(); ++i) {
+		done[i].conn->busy = false;
+		apply_action(connections, io, *done[i].conn, done[i].action);
+	}
+}
+
+/*
+	Serves an event on the event loop thread or hands it to a request thread
+*/
+void serve_connection(std::map<int, connection_t> &connections, io_backend_t &io, connection_t &conn, uint32_t events) {
+	if(work_pool == NULL) {
+		apply_action(connections, io, conn, handle_event(conn, events));
+		return;
+	}
+	conn.busy = true;
+	work_pool_push(conn, events);
+}
+
+connection_t &add_connection(std::map<int, connection_t> &connections, io_backend_t &io, int fd, bool owned) {
+	set_nonblock(fd);
 
+	if(owned) {
+		io_add_connection(io, fd, EPOLLIN | worker_vars.oneshot);
 	} else {
-		size = read(socket, buf, bufsize);
-		if(size < 0) {
-			log << "Can't read from reading socket" << endl;
-			exit(1);
-		}
+		io_add(io, fd, EPOLLIN | worker_vars.oneshot);
 	}
 
-	return size;
+	connection_t &conn = connections[fd];
+	conn.fd = fd;
+	conn.owned = owned;
+	conn.keep_alive_allowed = worker_vars.drain_deadline == 0;
+	conn.keep_alive = false;
+	conn.want_write = false;
+	conn.busy = false;
+	conn.requests = 0;
+	conn.last_active = time(NULL);
+	conn.input.clear();
+	http_parser_reset(conn.parser);
+	conn.output.clear();
+	conn.output_offset = 0;
+	conn.cached.reset();
+	conn.body = NULL;
+	conn.body_end = 0;
+	conn.body_offset = 0;
+	conn.file_fd = -1;
+	conn.file_offset = 0;
+	conn.file_end = 0;
+	conn.parts.clear();
+	conn.part_index = 0;
+	conn.sent = 0;
+	conn.queued.clear();
+	conn.queued_offset = 0;
+	conn.pipe_fds[0] = -1;
+	conn.pipe_fds[1] = -1;
+	conn.pipe_size = 0;
+	conn.pipe_pending = 0;
+	access_record_start(conn.access, 0, 0, 0);
+	METRICS_ADD(active_connections, 1);
+	return conn;
 }
 
 /*
-	HTTP-request handler
+	listen_socket is the worker's own listening socket in reuseport mode,
+	-1 in fdpass mode
 */
-
-void http_request_handler(int fd) {
-	log << "FD " << fd << ": http_request_handler" << endl;
+int workerProcess(int socket, int listen_socket) {
 
 	pid_t pid = getpid();
 
-	static char buffer[BUFFER_SIZE];
-	int recv_result = recv(fd, buffer, BUFFER_SIZE, MSG_NOSIGNAL);
+	log_info << "PID " << pid << ": " << (global_args.mode == REUSEPORT ? "reuseport" : "fdpass") << " mode, master socket = " << socket << ", listen socket = " << listen_socket << endl;
 
-	log << "PID " << pid << ": " << "fd = " << fd << ", recv_result = " << recv_result << ", errno = " << errno << endl;
+	worker_vars.socket = socket;
 
-	if(recv_result < 0) {
-		close(fd);
-		return;
-	}
+	io_backend_t io;
+	io_init(io, global_args.io_backend);
 
-	if(recv_result == 0 && (errno != EAGAIN)) {
-		log << "FD " <<  fd << " close" << endl;
-		shutdown(fd, SHUT_RDWR);
-		close(fd);
-		return;
+	log_info << "PID " << pid << ": " << io_backend_names[io.kind] << " backend" << endl;
+	ring_file_sends = io.kind == IO_URING;
+
+	if(listen_socket != -1) {
+		io_add_listener(io, listen_socket);
 	}
 
-	log << "===header===" << endl;
-	log << buffer;
-	log << "============" << endl;
+	io_add(io, socket, EPOLLIN);
 
-	int method_last_index = 0;
+	if(global_args.threads > 1) {
+		work_pool_start(io, global_args.threads);
+		log_info << "PID " << pid << ": " << global_args.threads << " request threads" << endl;
+	}
 
-	method _method = extract_method(buffer, BUFFER_SIZE, &method_last_index);
+	io_event_t events[MAX_EVENTS];
 
-	if(_method == UNKNOWN) {
-		log << "Incorrect method!" << endl;
-		send(fd, header_400, strlen(header_400), MSG_NOSIGNAL);
-		send(fd, body_400, strlen(body_400), MSG_NOSIGNAL);
-		shutdown(fd, SHUT_RDWR);
-		close(fd);
-		return;
-	}
+	std::map<int, connection_t> connections;
+	time_t last_sweep = time(NULL);
+
+	while(1) {
+		if(drain_requested && worker_vars.drain_deadline == 0) {
+			log_info << "PID " << pid << ": draining" << endl;
+			worker_vars.drain_deadline = time(NULL) + global_args.drain_timeout;
+			if(listen_socket != -1) {
+				// The socket stays open in the master and, after an upgrade, in
+				// the new workers, which accept what is queued on it
+				io_remove(io, listen_socket);
+				close(listen_socket);
+				listen_socket = -1;
+			}
+			for(std::map<int, connection_t>::iterator it = connections.begin(); it != connections.end(); ++it) {
+				it->second.keep_alive_allowed = false;
+			}
+		}
 
-	int route_begin_index = 0;
-	int route_end_index = 0;
+		int new_event_count = io_wait(io, events, MAX_EVENTS, worker_vars.drain_deadline != 0 ? 100 : 1000);
+		uint64_t woke_us = now_us();
 
-	extract_route(buffer, BUFFER_SIZE, &method_last_index, &route_begin_index, &route_end_index);
+		if(time(NULL) != last_sweep) {
+			close_idle_connections(connections, io);
+			last_sweep = time(NULL);
+		}
 
-	http_version _http_version =  extract_http_version(buffer, BUFFER_SIZE, &route_end_index);
+		if(new_event_count == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			log_error << "PID " << pid << ": " << io_backend_names[io.kind] << " wait error: " << strerror(errno) << endl;
+			return 1;
+		}
 
-	char * file_path = extract_file_path(buffer, &route_begin_index, &route_end_index);
+		for(int ei = 0; ei < new_event_count; ei++) {
+			int fd = events[ei].fd;
+			if(fd == listen_socket || events[ei].accepted != -1) {
+				struct sockaddr_in peer;
+				socklen_t peer_size = sizeof(peer);
+				int slave_socket = events[ei].accepted;
+				if(slave_socket == -1) {
+					slave_socket = accept(listen_socket, (struct sockaddr *)&peer, &peer_size);
+					if(slave_socket == -1) {
+						continue;
+					}
+				} else if(getpeername(slave_socket, (struct sockaddr *)&peer, &peer_size) == -1) {
+					peer.sin_addr.s_addr = 0;
+				}
+				log_debug << "PID " << pid << ": connection accepted: " << slave_socket << endl;
+				set_nodelay(slave_socket);
+				connection_t &conn = add_connection(connections, io, slave_socket, true);
+				uint64_t accepted_us = now_us();
+				access_record_start(conn.access, peer.sin_addr.s_addr, woke_us, accepted_us);
+				conn.access.received_us = accepted_us;
+			} else if(fd == socket) {
+				channel_message_t messages[HANDOFF_BATCH_MAX];
+				int received_fds[HANDOFF_BATCH_MAX];
+				int count = sock_fds_read(socket, messages, received_fds);
+				log_debug << "PID " << pid << ": got " << count << " fds" << endl;
+
+				if(count == 0) {
+					log_info << "PID " << pid << ": master socket closed" << endl;
+					return 0;
+				}
 
-	log << "file_path = '" << file_path << "'" << endl;
+				uint64_t received_us = now_us();
 
-	switch(_method) {
-		case GET: {
-			string full_file_path(global_args.directory);
+				for(int i = 0; i < count; ++i) {
+					int received_fd = received_fds[i];
+					if(received_fd == -1) {
+						continue;
+					}
 
-			if(strcmp(file_path, root_directory) == 0) {
-				full_file_path += default_page;
+					switch(messages[i].type) {
+						case CACHE_UPDATE: {
+							cache_apply(received_fd);
+							close(received_fd);
+							break;
+						}
+						default: {
+							METRICS_ADD(picked_up, 1);
+							connection_t &conn = add_connection(connections, io, received_fd, false);
+							conn.keep_alive_allowed = messages[i].type == HANDOFF_KEEP_ALIVE && worker_vars.drain_deadline == 0;
+							conn.requests = messages[i].requests;
+							access_record_start(conn.access, messages[i].peer, messages[i].woke_us, messages[i].sent_us);
+							conn.access.received_us = received_us;
+							serve_connection(connections, io, conn, EPOLLIN);
+							break;
+						}
+					}
+				}
+			} else if(work_pool != NULL && fd == work_pool->wakeup) {
+				work_pool_complete(connections, io);
 			} else {
-				full_file_path += file_path;
+				std::map<int, connection_t>::iterator it = connections.find(fd);
+				if(it == connections.end() || it->second.busy) {
+					// busy: add_connection() armed it before a thread took it.
+					// Only connections of the master are, and they are polled.
+					continue;
+				}
+				connection_t &conn = it->second;
+				if(events[ei].events & IO_RECEIVED) {
+					conn.input.append(events[ei].data, events[ei].size);
+					io_release_buffer(io, events[ei].buffer);
+				}
+				if(events[ei].events & IO_FILE_SENT) {
+					complete_file_send(conn, events[ei].size, events[ei].sent);
+				}
+				serve_connection(connections, io, conn, events[ei].events);
 			}
+		}
 
-			log << "full_file_path = '" << full_file_path << "'" << endl;
-
-			ifstream file_input(full_file_path.c_str(), std::ios::binary);
+		if(work_pool != NULL) {
+			work_pool_wake();
+		}
 
-			if(file_input && file_exists(full_file_path)) {
-				std::string content( (std::istreambuf_iterator<char>(file_input) ), (std::istreambuf_iterator<char>()) );
+		send_returns();
 
-				content_type _content_type = get_content_type(full_file_path.c_str());
+		if(worker_vars.drain_deadline != 0 && drain_connections(connections, io)) {
+			log_info << "PID " << pid << ": drained" << endl;
+			return 0;
+		}
+	}
 
-				switch(_content_type) {
-					case HTML: {
+	return 0;
+}
 
-						string html_response =  "HTTP/1.0 200 OK\r\nServer: MultiProcessWebServer v0.1\r\nContent-Type: text/html\r\nContent-Length: " + to_string(content.size()) + "\r\n\r\n";
+/*
+	MASTER
+*/
+void reap_children() {
+	child_exited = 0;
 
-						log << "response: " << html_response << endl;
+	int status;
+	pid_t pid;
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		log_info << "Child " << pid << " terminated with status " << status << endl;
+
+		if(pid == master_vars.upgrade_pid) {
+			// The new binary daemonizes, so its first process exits at once
+			master_vars.upgrade_pid = 0;
+			if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+				log_info << "Upgrade: new binary started" << endl;
+			} else {
+				log_error << "Upgrade: new binary failed to start" << endl;
+				rename(OLD_PID_FILE, PID_FILE);
+				master_vars.pid_file = PID_FILE;
+			}
+			continue;
+		}
 
-						send(fd, html_response.c_str(), html_response.size(), MSG_NOSIGNAL);
+		std::map<pid_t, int>::iterator it;
+		it = master_vars.socket_map.find(pid);
+		if(it != master_vars.socket_map.end()) {
+			int socket = it->second;
+			master_vars.socket_map.erase(it);
+			log_debug << "Writing socket " << socket << " deleted from map" << endl;
 
-						break;
-					}
-					case JS: {
-						send(fd, header_200_text_javascript, strlen(header_200_text_javascript), MSG_NOSIGNAL);
-						break;
-					}
-					case PNG: {
-						send(fd, header_200_image_png, strlen(header_200_image_png), MSG_NOSIGNAL);
-						break;
-					}
-					default: {
-						send(fd, header_200_application_octet_stream, strlen(header_200_application_octet_stream), MSG_NOSIGNAL);
-						break;
-					}
+			int index = -1;
+			for(int i = 0; i < master_vars.sockets.size(); ++i) {
+				if(master_vars.sockets[i] == socket) {
+					index = i;
+					break;
 				}
+			}
 
-				send(fd, content.c_str(), content.size(), MSG_NOSIGNAL);
-			} else {
-				log << "File '" << full_file_path << "' not found" << endl;
-				send(fd, header_404, strlen(header_404), MSG_NOSIGNAL);
+			if(index != -1) {
+				std::deque<queued_message_t> &queued = worker_queues[index].messages;
+				for(int i = 0; i < queued.size(); ++i) {
+					release_message(index, queued[i]);
+				}
+				worker_queues.erase(worker_queues.begin() + index);
+				master_vars.sockets.erase(master_vars.sockets.begin() + index);
+				if(master_vars.slots[index] != -1) {
+					metrics_slots[master_vars.slots[index]].pid = 0;
+				}
+				master_vars.slots.erase(master_vars.slots.begin() + index);
+				master_vars.positions.erase(master_vars.positions.begin() + index);
+				log_debug << "Writing socket " << socket << " deleted from vector" << endl;
 			}
+			close(socket);
+			--master_vars.children;
+		}
+	}
+}
 
-			break;
+int64_t worker_outstanding(int index) {
+	int slot = master_vars.slots[index];
+	return slot == -1 ? 0 : metrics_outstanding(metrics_slots[slot]);
+}
+
+void signal_workers(int sig) {
+	for(std::map<pid_t, int>::iterator it = master_vars.socket_map.begin(); it != master_vars.socket_map.end(); ++it) {
+		kill(it->first, sig);
+	}
+}
+
+void forward_log_reopen() {
+	log_reopen_forward = 0;
+	signal_workers(SIGUSR1);
+}
+
+// Queues each worker's batch, drops its fds from the master's epoll and map, and flushes
+void send_handoffs(vector<handoff_batch_t> &batches, int epoll) {
+	for(int worker = 0; worker < batches.size(); ++worker) {
+		handoff_batch_t &batch = batches[worker];
+		if(batch.count == 0) {
+			continue;
 		}
-		case POST: {
+		// Ownership passes to the worker when the message is queued: the master
+		// forgets the fd even if the socketpair is full, and re-watches it only
+		// if the send fails (see flush_worker)
+		for(int i = 0; i < batch.count; ++i) {
+			epoll_ctl(epoll, EPOLL_CTL_DEL, batch.fds[i], NULL);
+			master_vars.connections.erase(batch.fds[i]);
+			queue_message(worker, batch.messages[i], batch.fds[i]);
+		}
+		batch.count = 0;
+		flush_worker(worker);
+	}
+}
 
-			if(strcmp(file_path, route_calc) != 0) {
-				send(fd, header_404, strlen(header_404), MSG_NOSIGNAL);
-			} else {
+int worker_index(int socket) {
+	for(int i = 0; i < master_vars.sockets.size(); ++i) {
+		if(master_vars.sockets[i] == socket) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+	Takes back the kept-alive connections a worker returns
+*/
+void receive_returns(int epoll, int socket) {
+	channel_message_t messages[HANDOFF_BATCH_MAX];
+	int fds[HANDOFF_BATCH_MAX];
+	int count = sock_fds_read(socket, messages, fds);
+
+	if(count == 0) {
+		// The worker has gone; reap_children() closes the socket
+		epoll_ctl(epoll, EPOLL_CTL_DEL, socket, NULL);
+		return;
+	}
 
-				int body_begin_index = -1;
+	for(int i = 0; i < count; ++i) {
+		if(fds[i] == -1) {
+			continue;
+		}
+		if(messages[i].type != HANDOFF_RETURN || master_vars.drain_deadline != 0) {
+			close(fds[i]);
+			continue;
+		}
+		log_debug << "FD " << fds[i] << ": returned after " << messages[i].requests << " requests" << endl;
+		watch_connection(epoll, fds[i], messages[i].requests, messages[i].peer);
+	}
+}
 
-				extract_body(buffer, BUFFER_SIZE, &body_begin_index);
+/*
+	Picks the worker for a ready connection in fdpass mode, an index into
+	master_vars.sockets. Workers report every finished connection in their
+	metrics slot, so handed_off - completed is the number of connections
+	each one is busy with or has queued:
+	rr    - in turn, regardless of load
+	least - the fewest outstanding connections, ties in turn
+	p2c   - the less loaded of two random workers
+	With connection steering (-s) the worker on the CPU that received the
+	connection comes first. A stalled worker (see WORKER QUEUES) is passed
+	over by every policy while another one is not.
+*/
+int steer_worker(int fd) {
+	if(global_args.steering == STEER_OFF || affinity.cpus.empty()) {
+		return -1;
+	}
 
-				if(body_begin_index == -1) {
-					send(fd, header_400, strlen(header_400), MSG_NOSIGNAL);
-					send(fd, body_400, strlen(body_400), MSG_NOSIGNAL);
-				} else {
+	int cpu;
+	socklen_t cpu_size = sizeof(cpu);
+	if(getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_size) == -1 || cpu < 0) {
+		return -1;
+	}
 
-					int calc_result = calc(buffer, &body_begin_index);
+	int best = -1;
+	for(int i = 0; i < master_vars.sockets.size(); ++i) {
+		if(affinity_cpu(master_vars.positions[i]) == cpu && !worker_stalled(i) && (best == -1 || worker_outstanding(i) < worker_outstanding(best))) {
+			best = i;
+		}
+	}
+	return best;
+}
 
-					string json_result = "{\n\t\"result\": " + to_string(calc_result) + "\n}";
+int choose_worker(int &round_robin_index, int fd) {
+	int count = master_vars.sockets.size();
 
-					send(fd, header_200_application_json, strlen(header_200_application_json), MSG_NOSIGNAL);
-					send(fd, json_result.c_str(), json_result.size(), MSG_NOSIGNAL);
-				}
+	round_robin_index = (round_robin_index + 1) % count;
+
+	int steered = steer_worker(fd);
+	if(steered != -1) {
+		return steered;
+	}
+
+	if(global_args.dispatch == DISPATCH_ROUND_ROBIN || metrics_slots == NULL) {
+		for(int i = 0; i < count; ++i) {
+			int index = (round_robin_index + i) % count;
+			if(!worker_stalled(index)) {
+				round_robin_index = index;
+				break;
 			}
-			break;
 		}
+		return round_robin_index;
 	}
 
-	delete[] file_path;
+	if(global_args.dispatch == DISPATCH_TWO_CHOICES) {
+		int first = rand() % count;
+		int second = rand() % count;
+		if(worker_stalled(first)) {
+			first = second;
+		} else if(worker_stalled(second)) {
+			second = first;
+		}
+		if(!worker_stalled(first)) {
+			return worker_outstanding(first) <= worker_outstanding(second) ? first : second;
+		}
+		// Both stalled: the least loaded of the others
+	}
 
-	log << "FD " <<  fd << " close" << endl;
-	shutdown(fd, SHUT_RDWR);
-	close(fd);
+	int best = -1;
+	int64_t best_outstanding = 0;
+	for(int i = 0; i < count; ++i) {
+		int index = (round_robin_index + i) % count;
+		if(worker_stalled(index)) {
+			continue;
+		}
+		int64_t outstanding = worker_outstanding(index);
+		if(best == -1 || outstanding < best_outstanding) {
+			best = index;
+			best_outstanding = outstanding;
+			if(outstanding == 0) {
+				break;
+			}
+		}
+	}
+	return best == -1 ? round_robin_index : best;
 }
 
 /*
-	WORKER
+	UPGRADE AND DRAIN
+
+	SIGUSR2 starts global_args.argv again: the binary on disk, which may
+	be a new one. It inherits the listening sockets (LISTEN_FDS_ENV), so
+	connections queued on them wait for its workers instead of being
+	reset, and once its workers are forked it sends SIGTERM to this master
+	(OLD_MASTER_ENV). Until then both generations accept. The pid file of
+	the old master is OLD_PID_FILE; it is renamed back if the new binary
+	can not be started.
+
+	SIGTERM drains: the master stops accepting, closes the connections it
+	holds between requests and passes SIGTERM on to the workers (see
+	WORKER). It exits after the last worker; workers still running a
+	second after the deadline are killed.
 */
-int workerProcess(int socket) {
+// The descriptors the new binary must not inherit: all but the standard
+// ones and keep. Collected before the fork, as the child may only call
+// async-signal-safe functions while the master's other threads run.
+vector<int> fds_to_close(const vector<int> &keep) {
+	vector<int> fds;
+	DIR *dir = opendir("/proc/self/fd");
+	if(dir == NULL) {
+		return fds;
+	}
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL) {
+		int fd = atoi(entry->d_name);
+		if(fd > STDERR_FILENO && fd != dirfd(dir) && std::find(keep.begin(), keep.end(), fd) == keep.end()) {
+			fds.push_back(fd);
+		}
+	}
+	closedir(dir);
+	return fds;
+}
 
-	pid_t pid = getpid();
+// argv[0] as execve() wants it: searched in PATH the way execvp() would,
+// which the child can't call itself
+string executable_path(const char *name) {
+	const char *path = getenv("PATH");
+	if(strchr(name, '/') != NULL || path == NULL) {
+		return name;
+	}
+	for(const char *dir = path; ; ++dir) {
+		const char *end = strchr(dir, ':');
+		string candidate(dir, end == NULL ? strlen(dir) : end - dir);
+		candidate += candidate.empty() ? "./" : "/";
+		candidate += name;
+		if(access(candidate.c_str(), X_OK) == 0) {
+			return candidate;
+		}
+		if(end == NULL) {
+			return name;
+		}
+		dir = end;
+	}
+}
 
-	log << "PID " << pid << ": reading socket = " << socket << endl;
+void start_upgrade() {
+	upgrade_requested = 0;
 
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
+	if(master_vars.upgrade_pid != 0 || master_vars.drain_deadline != 0) {
+		log_warn << "Upgrade ignored: " << (master_vars.upgrade_pid != 0 ? "already starting" : "draining") << endl;
+		return;
+	}
 
-	int fd;
-	char buf[16];
-	ssize_t size;
+	string fds;
+	for(int i = 0; i < master_vars.listen_sockets.size(); ++i) {
+		append_format(fds, i == 0 ? "%d" : ",%d", master_vars.listen_sockets[i]);
+	}
+
+	// Everything the child needs is prepared here: it only closes and execs
+	string path = executable_path(global_args.argv[0]);
+	vector<string> variables(2);
+	variables[0] = LISTEN_FDS_ENV "=" + fds;
+	variables[1] = OLD_MASTER_ENV "=";
+	append_format(variables[1], "%d", getpid());
+	vector<char *> envp;
+	for(char **variable = environ; *variable != NULL; ++variable) {
+		if(strncmp(*variable, LISTEN_FDS_ENV "=", strlen(LISTEN_FDS_ENV "=")) != 0
+			&& strncmp(*variable, OLD_MASTER_ENV "=", strlen(OLD_MASTER_ENV "=")) != 0) {
+			envp.push_back(*variable);
+		}
+	}
+	for(int i = 0; i < variables.size(); ++i) {
+		envp.push_back(&variables[i][0]);
+	}
+	envp.push_back(NULL);
+	vector<int> close_fds = fds_to_close(master_vars.listen_sockets);
+
+	log_info << "Upgrade: starting " << path << ", listen sockets " << fds << endl;
 
-	while (1) {
-		log << "PID " << pid << ": wait fd..." << endl;
-		size = sock_fd_read(socket, buf, sizeof(buf), &fd);
-		log << "PID " << pid << ": got fd " << fd << ", size " << size << endl; 
-		
-		if(size <= 0){
+	// Before the fork: the new master writes PID_FILE as soon as it starts
+	rename(PID_FILE, OLD_PID_FILE);
+	master_vars.pid_file = OLD_PID_FILE;
+
+	pid_t pid = fork();
+	switch(pid) {
+		case -1: {
+			log_error << "Upgrade: can't fork: " << strerror(errno) << endl;
+			rename(OLD_PID_FILE, PID_FILE);
+			master_vars.pid_file = PID_FILE;
 			break;
 		}
-		
-		if(fd != -1) {
-			http_request_handler(fd);
+		case 0: {
+			for(int i = 0; i < close_fds.size(); ++i) {
+				close(close_fds[i]);
+			}
+			execve(path.c_str(), global_args.argv, &envp[0]);
+			_exit(127);
+		}
+		default: {
+			master_vars.upgrade_pid = pid;
 		}
 	}
+}
 
-	return 0;
+void start_drain(int epoll) {
+	master_vars.drain_deadline = time(NULL) + global_args.drain_timeout;
+
+	log_info << "Draining: " << master_vars.children << " workers, " << master_vars.connections.size()
+		<< " idle connections, deadline in " << global_args.drain_timeout << " s" << endl;
+
+	for(int i = 0; i < master_vars.listen_sockets.size(); ++i) {
+		epoll_ctl(epoll, EPOLL_CTL_DEL, master_vars.listen_sockets[i], NULL);
+		close(master_vars.listen_sockets[i]);
+	}
+	master_vars.listen_sockets.clear();
+
+	// Connections yet to send their first request go to the workers, which
+	// answer it; the others are idle between requests and are closed
+	int worker = 0;
+	for(std::map<int, keep_alive_t>::iterator it = master_vars.connections.begin(); it != master_vars.connections.end(); ++it) {
+		epoll_ctl(epoll, EPOLL_CTL_DEL, it->first, NULL);
+		if(it->second.requests > 0 || master_vars.sockets.empty()) {
+			close(it->first);
+			continue;
+		}
+		channel_message_t message;
+		memset(&message, 0, sizeof(message));
+		message.type = HANDOFF_CLOSE;
+		message.peer = it->second.peer;
+		message.woke_us = now_us();
+		queue_message(worker, message, it->first);
+		if(master_vars.slots[worker] != -1) {
+			metrics_slots[master_vars.slots[worker]].handed_off.fetch_add(1, std::memory_order_relaxed);
+		}
+		worker = (worker + 1) % master_vars.sockets.size();
+	}
+	master_vars.connections.clear();
+	for(int i = 0; i < master_vars.sockets.size(); ++i) {
+		flush_worker(i);
+	}
+
+	signal_workers(SIGTERM);
 }
 
-/*
-	MASTER
-*/
 int masterProcess() {
 
+	const char *old_master = getenv(OLD_MASTER_ENV);
+
+	log_init(global_args.access_log, old_master == NULL);
+
+	if(old_master != NULL) {
+		master_vars.old_master = atoi(old_master);
+		unsetenv(OLD_MASTER_ENV);
+	}
+
 	pid_t master_pid = getpid();
 
 	time_t my_time = time(NULL);
 
 	master_vars.children = 0;
 
-	log << "------------------------" << endl;
-	log << "Master " << VERSION << " starting..." << endl;
-	log << "------------------------" << endl;
+	log_info << "------------------------" << endl;
+	log_info << "Master " << VERSION << " starting..." << endl;
+	log_info << "------------------------" << endl;
+
+	log_info << "Current time: " << ctime(&my_time);
+
+	log_info << "Master PID " << master_pid << endl;
 
-	log << "Current time: " << ctime(&my_time);
+	if(master_vars.old_master != 0) {
+		log_info << "Upgrade from master " << master_vars.old_master << endl;
+	}
 
-	log << "Master PID " << master_pid << endl;
+	log_info << "Processor count: " << processor_count << endl;
 
-	log << "Processor count: " << processor_count << endl;
+	log_info << "Workers: " << global_args.workers << " x " << global_args.threads << " request threads" << endl;
 
-	log << "SOMAXCONN: " << SOMAXCONN << endl;
+	log_info << "SOMAXCONN: " << SOMAXCONN << endl;
 
 	writePid(master_pid);
 
+	cache_fill();
+
+	metrics_init(global_args.workers);
+
+	srand(getpid());
+
 	struct sigaction act;
 	act.sa_sigaction = masterSignalHandler;
 	act.sa_flags = SA_SIGINFO;
 
+	sigemptyset(&act.sa_mask);
+
 	if(sigaction(SIGCHLD, &act, NULL) == -1) {
-		log << "Error of sigaction SIGCHLD" << endl;
+		log_error << "Error of sigaction SIGCHLD" << endl;
+	}
+
+	if(sigaction(SIGUSR1, &act, NULL) == -1) {
+		log_error << "Error of sigaction SIGUSR1" << endl;
+	}
+
+	if(sigaction(SIGUSR2, &act, NULL) == -1) {
+		log_error << "Error of sigaction SIGUSR2" << endl;
+	}
+
+	if(sigaction(SIGTERM, &act, NULL) == -1) {
+		log_error << "Error of sigaction SIGTERM" << endl;
 	}
  
 	pid_t pid;
 
-	int master_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
-	int flag = 1;
-	if (setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) == -1) {
-		log << "Reuse addr error: " << errno << endl;
-		log << strerror(errno) << endl;
-	} else {
-		log << "Reuse addr: OK" << endl;
+	if(global_args.mode == REUSEPORT && !reuseport_supported()) {
+		log_warn << "SO_REUSEPORT is not supported, falling back to fd passing" << endl;
+		global_args.mode = FDPASS;
 	}
 
-	log << "ip: " << global_args.host << endl;
-	log << "port: " << global_args.port << endl;
+	log_info << "Listen mode: " << (global_args.mode == REUSEPORT ? "reuseport" : "fdpass") << endl;
 
-	struct sockaddr_in SockAddr;
+	affinity_init();
 
-	SockAddr.sin_family = AF_INET;
-	SockAddr.sin_port = htons(global_args.port);
+	open_listen_sockets();
 
-	if(global_args.host.compare("localhost") == 0) {
-		log << "localhost => 127.0.0.1" << endl;
-		SockAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-	} else {
-		SockAddr.sin_addr.s_addr = inet_addr(global_args.host.c_str());
-	}
+	int master_socket = -1;
+	int epoll = epoll_create1(0);
+	master_vars.epoll = epoll;
 
-	if(::bind(master_socket, (struct sockaddr *)(&SockAddr), sizeof(SockAddr)) == -1) {
-		log << "Bind error: " << errno << endl;
-		log << strerror(errno) << endl;
-		exit(EXIT_FAILURE);
-	} else {
-		log << "Bind: OK" << endl;
-	}
+	struct epoll_event event;
 
-	set_nonblock(master_socket);
+	if(global_args.mode == FDPASS) {
+		master_socket = master_vars.listen_sockets[0];
 
-	if(listen(master_socket, SOMAXCONN) == -1) {
-		log << "Listen error: " << errno << endl;
-		log << strerror(errno) << endl;
-		exit(EXIT_FAILURE);
-	} else {
-		log << "Listen: OK" << endl;
+		event.data.fd = master_socket;
+		event.events = EPOLLIN;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, master_socket, &event);
 	}
 
-	int epoll = epoll_create1(0);
+	int inotify = cache_watch();
 
-	struct epoll_event event;
-	event.data.fd = master_socket;
-	event.events = EPOLLIN;
-	epoll_ctl(epoll, EPOLL_CTL_ADD, master_socket, &event);
+	int builder = -1;
+
+	if(inotify != -1) {
+		event.data.fd = inotify;
+		event.events = EPOLLIN;
+		epoll_ctl(epoll, EPOLL_CTL_ADD, inotify, &event);
+
+		builder = cache_builder_start();
+		if(builder != -1) {
+			event.data.fd = builder;
+			event.events = EPOLLIN;
+			epoll_ctl(epoll, EPOLL_CTL_ADD, builder, &event);
+		}
+	}
 
 	int round_robin_index = 0;
 
-	char required_buf[1];
-	required_buf[0] = '1';
+	vector<handoff_batch_t> batches;
+
+	time_t last_sweep = time(NULL);
 
 	while(1) {
 
+		if(child_exited) {
+			reap_children();
+		}
+
+		if(log_reopen_forward) {
+			forward_log_reopen();
+		}
+
+		if(upgrade_requested) {
+			start_upgrade();
+		}
+
+		if(drain_requested && master_vars.drain_deadline == 0) {
+			start_drain(epoll);
+			master_socket = -1;
+		}
+
+		if(master_vars.drain_deadline != 0) {
+			if(master_vars.children == 0) {
+				break;
+			}
+			if(time(NULL) > master_vars.drain_deadline + 1) {
+				signal_workers(SIGKILL);
+			}
+		}
+
 		bool fork_created = false;
 
-		while(master_vars.children < processor_count) {
+		while(master_vars.drain_deadline == 0 && master_vars.children < global_args.workers) {
 			usleep(0.5 * 1000 * 1000);
 
 			int sv[2];
 
-			if(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) < 0) {
-				log << "Can't create socketpair" << endl;
+			if(socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, sv) < 0) {
+				log_error << "Can't create socketpair" << endl;
 				continue;
 			}
 
+			int slot = metrics_free_slot();
+			metrics_reset(slot);
+			int position = free_position();
+			int listener = global_args.mode == REUSEPORT ? position : -1;
+
 			pid = fork();
 			++master_vars.children;
 
 			switch(pid) {
 				case -1: {
-					log << "Can't fork: " << errno << endl;
+					log_error << "Can't fork: " << errno << endl;
+					--master_vars.children;
+					close(sv[0]);
+					close(sv[1]);
 					break;
 				}
 				case 0: {
+					log_start();
+					affinity_apply(position);
 					close(sv[0]);
-					int exitCode = workerProcess(sv[1]);
-					log << "Exit for " << getpid() << " with code " << exitCode << endl;
+					for(int i = 0; i < master_vars.sockets.size(); ++i) {
+						close(master_vars.sockets[i]);
+					}
+					for(int i = 0; i < master_vars.listen_sockets.size(); ++i) {
+						if(i != listener) {
+							close(master_vars.listen_sockets[i]);
+						}
+					}
+					if(inotify != -1) {
+						close(inotify);
+					}
+					if(builder != -1) {
+						close(builder);
+					}
+					close(epoll);
+					metrics_attach(slot);
+					int exitCode = workerProcess(sv[1], listener == -1 ? -1 : master_vars.listen_sockets[listener]);
+					log_info << "Exit for " << getpid() << " with code " << exitCode << endl;
 					exit(exitCode);
 				}
 				default: {
 					close(sv[1]);
+					set_nonblock(sv[0]);
+
+					// Kept-alive connections come back through it
+					struct epoll_event event;
+					event.data.fd = sv[0];
+					event.events = EPOLLIN;
+					epoll_ctl(epoll, EPOLL_CTL_ADD, sv[0], &event);
+
 					master_vars.socket_map.insert(make_pair(pid, sv[0]));
 					master_vars.sockets.push_back(sv[0]);
+					worker_queues.push_back(worker_queue_t());
+					master_vars.slots.push_back(slot);
+					master_vars.positions.push_back(position);
+					if(slot != -1) {
+						metrics_slots[slot].pid = pid;
+					}
 					fork_created = true;
 				}
 			}
@@ -742,66 +6384,112 @@ int masterProcess() {
 		if(fork_created) {
 			std::map<pid_t, int>::iterator it = master_vars.socket_map.begin();
 			while(it != master_vars.socket_map.end()) {
-				log << "PID " << it->first << ": writing_socket = " << it->second << endl;
+				log_info << "PID " << it->first << ": writing_socket = " << it->second << endl;
 				it++;
 			}
 
 			for(int i = 0; i < master_vars.sockets.size(); ++i) {
-				log << i << ") " << master_vars.sockets[i] << endl;
+				log_info << i << ") " << master_vars.sockets[i] << endl;
+			}
+
+			if(master_vars.old_master != 0) {
+				log_info << "Upgrade: stopping master " << master_vars.old_master << endl;
+				kill(master_vars.old_master, SIGTERM);
+				master_vars.old_master = 0;
 			}
 		}
 
+		// In reuseport mode workers accept by themselves and the master only
+		// supervises them and the cache. epoll_wait() is interrupted by
+		// SIGCHLD, so a dead worker is replaced at once.
 		struct epoll_event events[MAX_EVENTS];
-		log << endl;
-		log << "wait events..." << endl; 
-		int new_event_count = epoll_wait(epoll, events, MAX_EVENTS, -1);
-		log << "new_event_count = " << new_event_count << endl;
+		log_debug << "wait events..." << endl; 
+		int new_event_count = epoll_wait(epoll, events, MAX_EVENTS, 1000);
+		uint64_t woke_us = now_us();
+		log_debug << "new_event_count = " << new_event_count << endl;
+
+		if(time(NULL) != last_sweep) {
+			close_idle_connections(master_vars.connections, epoll);
+			last_sweep = time(NULL);
+		}
+
+		batches.resize(master_vars.sockets.size());
 
 		for(int ei = 0; ei < new_event_count; ei++) {
 			int fd = events[ei].data.fd;
-			if(fd == master_socket) {
-				log << "New client connection..." << endl;
-				int slave_socket = accept(master_socket, 0, 0);
-				log << "Connection accepted: " << slave_socket << endl;
+			if(fd == inotify) {
+				cache_handle_events(inotify);
+			} else if(fd == builder) {
+				cache_builder_complete();
+			} else if(fd == master_socket) {
+				log_debug << "New client connection..." << endl;
+				struct sockaddr_in peer;
+				socklen_t peer_size = sizeof(peer);
+				int slave_socket = accept(master_socket, (struct sockaddr *)&peer, &peer_size);
+				if(slave_socket == -1) {
+					continue;
+				}
+				log_debug << "Connection accepted: " << slave_socket << endl;
 				set_nonblock(slave_socket);
-
-				struct epoll_event event;
-				event.data.fd = slave_socket;
-				event.events = EPOLLIN;
-
-				epoll_ctl(epoll, EPOLL_CTL_ADD, slave_socket, &event);
+				set_nodelay(slave_socket);
+				watch_connection(epoll, slave_socket, 0, peer.sin_addr.s_addr);
+			} else if(worker_index(fd) != -1) {
+				if(events[ei].events & EPOLLOUT) {
+					flush_worker(worker_index(fd));
+				}
+				if(events[ei].events & ~EPOLLOUT) {
+					receive_returns(epoll, fd);
+				}
 			} else {
-				log << "---------" << endl;
-				log << "FD " << fd << ": events = " << events[ei].events << endl;
+				log_debug << "---------" << endl;
+				log_debug << "FD " << fd << ": events = " << events[ei].events << endl;
 
 				if(events[ei].events & EPOLLHUP) {
-					log << "FD " << fd << ": EPOLLHUP" << endl;
+					log_debug << "FD " << fd << ": EPOLLHUP" << endl;
+					epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
 					close(fd);
+					master_vars.connections.erase(fd);
 					continue;
 				}
 
 				if(events[ei].events & EPOLLERR) {
-					log << "FD " << fd << ": EPOLLERR" << endl;
+					log_debug << "FD " << fd << ": EPOLLERR" << endl;
+					epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
 					close(fd);
+					master_vars.connections.erase(fd);
 					continue;
 				}
 
+				keep_alive_t &state = master_vars.connections[fd];
+
 				if(master_vars.sockets.size() > 0) {
-					while(round_robin_index >= master_vars.sockets.size()) {
-						round_robin_index -= master_vars.sockets.size();
+					int worker = choose_worker(round_robin_index, fd);
+					log_debug << "worker = " << worker << ":" << master_vars.sockets[worker] << endl;
+					// Counted before the send, so the worker never picks up more than was
+					// handed off and choose_worker() sees the rest of this batch
+					int slot = master_vars.slots[worker];
+					if(slot != -1) {
+						metrics_slots[slot].handed_off.fetch_add(1, std::memory_order_relaxed);
 					}
-					log << "round_robin_index = " << round_robin_index << ":" << master_vars.sockets[round_robin_index] << endl;
-					ssize_t size = sock_fd_write(master_vars.sockets[round_robin_index], required_buf, 1, fd);
-					log << "++round_robin_index" << endl;
-					++round_robin_index;
+
+					handoff_batch_t &batch = batches[worker];
+					channel_message_t &message = batch.messages[batch.count];
+					message.type = (state.requests + 1 < global_args.keep_alive_max_requests) ? HANDOFF_KEEP_ALIVE : HANDOFF_CLOSE;
+					message.requests = state.requests;
+					message.peer = state.peer;
+					message.woke_us = woke_us;
+					batch.fds[batch.count++] = fd;
 				} else {
-					log << "No socketpairs!" << endl;
+					log_warn << "No socketpairs!" << endl;
 				}
 			}
 		}
 
+		send_handoffs(batches, epoll);
 	}
 
+	log_info << "Master " << master_pid << " drained" << endl;
+	unlink(master_vars.pid_file);
 
 	return 0;
 }
@@ -815,9 +6503,23 @@ int main(int argc, char *argv[]) {
 	global_args.host = "127.0.0.1";
 	global_args.port = 11777;
 	global_args.directory = "/tmp/";
+	global_args.mode = REUSEPORT;
+	global_args.dispatch = DISPATCH_LEAST_LOADED;
+	global_args.io_backend = IO_EPOLL;
+	global_args.workers = processor_count;
+	global_args.threads = 1;
+	global_args.affinity = "off";
+	global_args.steering = STEER_OFF;
+	global_args.keep_alive_max_requests = 100;
+	global_args.keep_alive_timeout = 5;
+	global_args.cache_size = 64 * 1024 * 1024;
+	global_args.access_log = true;
+	global_args.etag = ETAG_STRONG;
+	global_args.drain_timeout = 10;
+	global_args.argv = argv;
 
 	if(argc > 1) {
-		while( (key = getopt(argc, argv, "h:p:d:")) != -1 ) {
+		while( (key = getopt(argc, argv, "h:p:d:m:r:t:c:l:a:b:i:w:j:g:k:s:e:x:f:")) != -1 ) {
 			switch(key) {
 				case 'h':
 					global_args.host = string(optarg);
@@ -828,6 +6530,90 @@ int main(int argc, char *argv[]) {
 				case 'd':
 					global_args.directory = string(optarg);
 					break;
+				case 'm':
+					if(strcmp(optarg, "fdpass") == 0) {
+						global_args.mode = FDPASS;
+					} else if(strcmp(optarg, "reuseport") == 0) {
+						global_args.mode = REUSEPORT;
+					} else {
+						cerr << "Unknown mode: " << optarg << endl;
+					}
+					break;
+				case 'b':
+					if(strcmp(optarg, "rr") == 0) {
+						global_args.dispatch = DISPATCH_ROUND_ROBIN;
+					} else if(strcmp(optarg, "least") == 0) {
+						global_args.dispatch = DISPATCH_LEAST_LOADED;
+					} else if(strcmp(optarg, "p2c") == 0) {
+						global_args.dispatch = DISPATCH_TWO_CHOICES;
+					} else {
+						cerr << "Unknown dispatch policy: " << optarg << endl;
+					}
+					break;
+				case 'i':
+					if(strcmp(optarg, "epoll") == 0) {
+						global_args.io_backend = IO_EPOLL;
+					} else if(strcmp(optarg, "uring") == 0) {
+						global_args.io_backend = IO_URING;
+					} else {
+						cerr << "Unknown I/O backend: " << optarg << endl;
+					}
+					break;
+				case 'w':
+					global_args.workers = max(atoi(optarg), 1);
+					break;
+				case 'j':
+					global_args.threads = max(atoi(optarg), 1);
+					break;
+				case 'k':
+					global_args.affinity = string(optarg);
+					break;
+				case 's':
+					if(strcmp(optarg, "off") == 0) {
+						global_args.steering = STEER_OFF;
+					} else if(strcmp(optarg, "cpu") == 0) {
+						global_args.steering = STEER_INCOMING_CPU;
+					} else if(strcmp(optarg, "cbpf") == 0) {
+						global_args.steering = STEER_CBPF;
+					} else {
+						cerr << "Unknown steering: " << optarg << endl;
+					}
+					break;
+				case 'r':
+					global_args.keep_alive_max_requests = atoi(optarg);
+					break;
+				case 't':
+					global_args.keep_alive_timeout = atoi(optarg);
+					break;
+				case 'c':
+					global_args.cache_size = (size_t)atoi(optarg) * 1024 * 1024;
+					break;
+				case 'g':
+					global_args.drain_timeout = atoi(optarg);
+					break;
+				case 'l':
+					log_level = atoi(optarg);
+					break;
+				case 'a':
+					global_args.access_log = atoi(optarg) != 0;
+					break;
+				case 'e':
+					if(strcmp(optarg, "off") == 0) {
+						global_args.etag = ETAG_OFF;
+					} else if(strcmp(optarg, "strong") == 0) {
+						global_args.etag = ETAG_STRONG;
+					} else if(strcmp(optarg, "weak") == 0) {
+						global_args.etag = ETAG_WEAK;
+					} else {
+						cerr << "Unknown ETag mode: " << optarg << endl;
+					}
+					break;
+				case 'x':
+					global_args.cache_policy_file = string(optarg);
+					break;
+				case 'f':
+					global_args.mime_types_file = string(optarg);
+					break;
 				case '?':
 					cerr << "Unknown key" << endl;
 					break;
@@ -837,6 +6623,33 @@ int main(int argc, char *argv[]) {
 	cout << "host = " << global_args.host << endl;
 	cout << "port = " << global_args.port << endl;
 	cout << "directory = " << global_args.directory << endl;
+	cout << "mode = " << (global_args.mode == REUSEPORT ? "reuseport" : "fdpass") << endl;
+	cout << "dispatch = " << dispatch_names[global_args.dispatch] << endl;
+	cout << "I/O backend = " << io_backend_names[global_args.io_backend] << endl;
+	cout << "workers = " << global_args.workers << endl;
+	cout << "threads per worker = " << global_args.threads << endl;
+	cout << "CPU affinity = " << global_args.affinity << endl;
+	cout << "steering = " << steering_names[global_args.steering] << endl;
+	cout << "keep-alive max requests = " << global_args.keep_alive_max_requests << endl;
+	cout << "keep-alive timeout = " << global_args.keep_alive_timeout << endl;
+	cout << "cache size = " << global_args.cache_size << endl;
+	cout << "log level = " << log_level << endl;
+	cout << "access log = " << global_args.access_log << endl;
+	cout << "ETag = " << etag_names[global_args.etag] << endl;
+	cout << "cache policy = " << (global_args.cache_policy_file.empty() ? "none" : global_args.cache_policy_file) << endl;
+	cout << "MIME types = " << (global_args.mime_types_file.empty() ? "built-in" : global_args.mime_types_file) << endl;
+	cout << "drain timeout = " << global_args.drain_timeout << endl;
+
+	scanner_init();
+	cout << "scanner = " << scanner_name << endl;
+
+	if(!global_args.cache_policy_file.empty() && !cache_policy_load(global_args.cache_policy_file.c_str())) {
+		return -1;
+	}
+
+	if(!global_args.mime_types_file.empty() && !mime_types_load(global_args.mime_types_file.c_str())) {
+		return -1;
+	}
 
 	pid_t launcher_pid = getpid();
 